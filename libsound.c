@@ -0,0 +1,2374 @@
+/**
+ *
+ *      libsound.c
+ *      Renders the sounds that sound.c writes to .wav files, for sound.c and
+ *  for any other program that links against libsound. See sound.h for the
+ *  interface.
+ *
+**/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "sound.h"
+
+#define PI (3.14159265358979323846264338327950288419716939937)
+#define PI_LONG (3.14159265358979323846264338327950288419716939937L)
+
+/* Converts a phase_t to a fraction of a cycle in the range [0, 1). */
+#define PHASE_TO_UNIT(phase) ((double)(phase) * 0x1p-64)
+
+/* Converts a phase_t to a fraction of a cycle in the range [-0.5, 0.5). */
+#define PHASE_TO_SIGNED_UNIT(phase) ((double)(int64_t)(phase) * 0x1p-64)
+
+/* The number of samples mixed at a time. */
+#define RENDER_BLOCK_SIZE (4096)
+
+/* The alignment of each array in a partial table, the size of a cache line. */
+#define CACHE_LINE_SIZE (64)
+
+/**
+ *  The longest common period, in samples, that is rendered once and then
+ *  copied for the rest of the sound rather than rendered over and over.
+**/
+#define MAX_TILE_PERIOD (1 << 22)
+
+/**
+ *  The number of samples the sine kernel extrapolates from a single exact
+ *  phase before going back to the oscillator for a fresh one.
+**/
+#define SINE_RUN_LENGTH (256)
+
+/**
+ *  The number of samples the rotation kernel produces from a single seed, and
+ *  the number of independent phasors each of its vector lanes is split into
+ *  so that rotations don't have to wait on one another. The vector kernels
+ *  spell out all four chains by hand.
+ *  The phasor's magnitude is never renormalized: re-seeding it from the exact
+ *  phase every ROTATION_RUN_LENGTH samples does that job, since rounding can
+ *  only let it drift for that long. The error stays below 1.1e-12 in double
+ *  and 4e-6 in float, far under a 16-bit step, so a correction per sample or
+ *  block would cost time without changing the output.
+**/
+#define ROTATION_RUN_LENGTH (1024)
+#define ROTATION_CHAINS (4)
+
+/**
+ *  Harmonic stacks of at least MIN_HARMONIC_STACK sine partials are generated
+ *  HARMONIC_RUN_LENGTH samples at a time by the Chebyshev recurrence, with
+ *  each vector lane split into HARMONIC_CHAINS independent chains like the
+ *  rotation kernel's.
+**/
+#define MIN_HARMONIC_STACK (4)
+#define HARMONIC_RUN_LENGTH (256)
+#define HARMONIC_CHAINS (4)
+
+/**
+ *  With --oversample, each halving of the sample rate is done by a half-band
+ *  filter with HALF_BAND_TAPS nonzero taps on either side of its center, which
+ *  reach HALF_BAND_REACH input samples out. OVERSAMPLE_BLOCK_SIZE samples are
+ *  rendered at a time, at up to MAX_OVERSAMPLE times the sample rate.
+**/
+#define HALF_BAND_TAPS          (16)
+#define HALF_BAND_REACH         (2 * HALF_BAND_TAPS - 1)
+#define MAX_OVERSAMPLE          (8)
+#define OVERSAMPLE_BLOCK_SIZE   (RENDER_BLOCK_SIZE / MAX_OVERSAMPLE)
+#define OVERSAMPLE_BUFFER_SIZE  (MAX_OVERSAMPLE *                              \
+                                 (OVERSAMPLE_BLOCK_SIZE + 2 * HALF_BAND_REACH))
+
+/**
+ *  Exponential envelope segments head for a point ENVELOPE_OVERSHOOT of their
+ *  rise or fall past where they end, and stop when they get there, so that they
+ *  arrive in finite time with a clear bend rather than creeping up on it.
+**/
+#define ENVELOPE_OVERSHOOT (0.01)
+
+/**
+ *  Adding and then subtracting this rounds any double of magnitude less than
+ *  2^51 to the nearest integer, without a call into libm.
+**/
+#define ROUNDING_CONSTANT (0x1.8p52)
+
+/**
+ *  The Taylor series for sin(x) through the x^21 term, evaluated with Horner's
+ *  method. On [0, pi/2] the truncation error is below 1.3e-18, well under the
+ *  rounding error of the arithmetic itself. Works on scalars and on vectors
+ *  alike.
+**/
+#define SINE_REDUCED(x, x2) ((x) * (1 + (x2) * (-1 / 6.0 + (x2) *             \
+    (1 / 120.0 + (x2) * (-1 / 5040.0 + (x2) * (1 / 362880.0 + (x2) *           \
+    (-1 / 39916800.0 + (x2) * (1 / 6227020800.0 + (x2) *                       \
+    (-1 / 1307674368000.0 + (x2) * (1 / 355687428096000.0 + (x2) *             \
+    (-1 / 121645100408832000.0 + (x2) *                                        \
+    (1 / 51090942171709440000.0))))))))))))
+
+/**
+ *  Each wavetable holds one cycle of its wave in 2^WAVETABLE_BITS points, at
+ *  WAVETABLE_LEVELS levels of detail. Level L keeps the first
+ *  WAVETABLE_HARMONICS >> L harmonics of the wave and drops the rest.
+**/
+#define WAVETABLE_BITS      (13)
+#define WAVETABLE_SIZE      (1 << WAVETABLE_BITS)
+#define WAVETABLE_LEVELS    (12)
+#define WAVETABLE_HARMONICS (WAVETABLE_SIZE / 4)
+
+/**
+ *  The number of points one cycle of a wave is sampled at in order to find the
+ *  harmonics for its wavetable.
+**/
+#define WAVETABLE_ANALYSIS_SIZE (16 * WAVETABLE_SIZE)
+
+/**
+ *  The Q31 render path reads sine waves from a table of 2^Q31_SINE_BITS points
+ *  per cycle, and mixes in 64-bit fixed point with Q31_MIX_UNIT to each 16-bit
+ *  step.
+**/
+#define Q31_SINE_BITS   (12)
+#define Q31_SINE_SIZE   (1 << Q31_SINE_BITS)
+#define Q31_MIX_UNIT    (1 << 16)
+
+/**
+ *  The inverse-FFT additive engine synthesizes frames of IFFT_FRAME_SIZE
+ *  samples, centered IFFT_HOP_SIZE samples apart, spreading each partial over
+ *  the IFFT_KERNEL_BINS bins of the frame's spectrum nearest its frequency.
+ *  The spectrum of the window those bins come from is tabulated at
+ *  IFFT_KERNEL_OVERSAMPLE points per bin. With --additive auto, the engine
+ *  takes over from the direct sum at IFFT_THRESHOLD partials, not counting
+ *  those in harmonic stacks, which the direct sum handles faster still. It
+ *  only does so at float or double precision: long double and Q31 renders are
+ *  asked for by name, so they keep their own paths.
+**/
+#define IFFT_FRAME_SIZE         (4096)
+#define IFFT_HOP_SIZE           (IFFT_FRAME_SIZE / 4)
+#define IFFT_KERNEL_BINS        (9)
+#define IFFT_KERNEL_OVERSAMPLE  (512)
+#define IFFT_KERNEL_SIZE        (IFFT_KERNEL_BINS * IFFT_KERNEL_OVERSAMPLE + 2)
+#define IFFT_THRESHOLD          (1024)
+
+/* The number of values of enum sound_wave. */
+#define NUM_WAVES (SOUND_WAVE_POLYBLEP_TRIANGLE + 1)
+
+/* Is the SIMD sine kernel available for this architecture and compiler? */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_SINE_KERNELS
+#endif
+
+
+/**
+ *  The phase of an oscillator, as a fraction of a cycle scaled to the full
+ *  range of a uint64_t. Wraps around on its own at the end of every cycle.
+**/
+typedef uint64_t phase_t;
+
+/**
+ *  The envelope of a sound, in samples from its start, as levels from 0 to 1:
+ *  it rises from silence to 1 by <attack_end>, falls to <sustain> by
+ *  <decay_end> and stays there. If <end> isn't 0, it falls from wherever it is
+ *  at <release_start> to silence at <end>, and stays silent. Each segment
+ *  follows the <curve>. <release_start> is never before <attack_end>, or if
+ *  the sound is too short for that, before the middle of it.
+**/
+struct envelope {
+    uint64_t attack_end;
+    uint64_t decay_end;
+    uint64_t release_start;
+    uint64_t end;
+    double sustain;
+    enum sound_curve curve;
+};
+
+/**
+ *  One segment of an envelope: from level <from> at sample <first> to level
+ *  <to> at sample <last>.
+**/
+struct segment {
+    uint64_t first;
+    uint64_t last;
+    double from;
+    double to;
+};
+
+/**
+ *  Every partial of the sound, stored as one array per field so that the render
+ *  loop streams through each of them in order. Each array holds <size> entries
+ *  and starts on a cache line of its own.
+ *  A partial has a <frequency> in Hz, a <phase> telling where it currently is
+ *  in its cycle, an <increment> telling how far it advances with each sample,
+ *  and a <gain> it is mixed in with.
+**/
+struct partial_table {
+    size_t size;
+    long double *frequency;
+    phase_t *phase;
+    phase_t *increment;
+    double *gain;
+};
+
+/**
+ *  The render loops for a single wave, one for each precision samples can be
+ *  mixed in. Each adds samples of the wave with a given gain to an array,
+ *  starting at a given phase and advancing by a given increment each sample.
+**/
+struct wave_loops {
+    void (*float_loop)(float *, size_t, phase_t, phase_t, double);
+    void (*double_loop)(double *, size_t, phase_t, phase_t, double);
+    void (*long_double_loop)(long double *, size_t, phase_t, phase_t,
+                               double);
+    void (*q31_loop)(int64_t *, size_t, phase_t, phase_t, double);
+};
+
+/**
+ *  How each enum sound_wave is rendered: the <function> giving its samples,
+ *  and the <loops> rendering many of them at once. Its wavetable is that of
+ *  the <plain> wave, which only differs from it where it aliases.
+**/
+struct wave {
+    double (*function)(phase_t);
+    const struct wave_loops *loops;
+    enum sound_wave plain;
+};
+
+/**
+ *  Everything needed to render a sound, all worked out by sound_reset() but
+ *  the phases of its partials. Every array has room for <capacity> partials,
+ *  however many the sound has at the moment.
+**/
+struct sound {
+    size_t capacity;
+    struct partial_table partials;
+    /**
+     *  The number of partials in the harmonic stack beginning at each partial,
+     *  from find_harmonic_stacks(), or NULL to render every partial on its own.
+     *  They're kept in <stack_room> when there are any.
+    **/
+    size_t *stacks;
+    size_t *stack_room;
+    /**
+     *  How many times the sample rate to render at before decimating, and the
+     *  increments of the partials at that rate, or NULL to render at the sample
+     *  rate itself. The inverse-FFT engine leaves them be, since the sines it
+     *  renders have nothing to alias. The increments are kept in
+     *  <increment_room> when there are any.
+    **/
+    uint8_t oversample;
+    phase_t *oversampled_increments;
+    phase_t *increment_room;
+    double (*wave_function)(phase_t);
+    const struct wave_loops *wave_loops;
+    /* Whether, and how, to render from the levels of <wavetable>. */
+    enum sound_wavetable wavetable_mode;
+    double *const *wavetable;
+    /* The sine kernels, picked to match the enum sound_sine_kernel. */
+    void (*sine_kernel)(double *, size_t, phase_t, phase_t, double);
+    void (*sine_kernel_float)(float *, size_t, phase_t, phase_t, double);
+    /**
+     *  Render samples of the sound in the chosen precision, quantized to
+     *  16-bit PCM or as doubles in which one 16-bit step is 1.
+    **/
+    void (*render_pcm16)(const struct sound *, uint8_t *, uint64_t, size_t);
+    void (*render_double)(const struct sound *, double *, uint64_t, size_t);
+    /**
+     *  Whether the sound has an <envelope>, and if so, how it renders before
+     *  the envelope is applied, and how many samples it has moved along since
+     *  it started.
+    **/
+    uint8_t enveloped;
+    struct envelope envelope;
+    void (*render_unshaped)(const struct sound *, double *, uint64_t, size_t);
+    uint64_t position;
+};
+
+
+static int init_partial_table(struct partial_table *, size_t);
+static void set_partial(struct partial_table *, size_t, long double, double,
+                        uint32_t);
+static void free_partial_table(struct partial_table *);
+static void *aligned_malloc(size_t);
+
+/* Declares the functions that DEFINE_RENDER_PATH() defines for <name>. */
+#define DECLARE_RENDER_PATH(name, type)                                        \
+static void name(const struct sound *, uint8_t *, uint64_t, size_t);           \
+static void name##_double(const struct sound *, double *, uint64_t, size_t);   \
+static void name##_mix(const struct sound *, const phase_t *, type *,          \
+                       uint64_t, size_t);                                      \
+static void name##_mix_double(const struct sound *, const phase_t *, double *, \
+                              uint64_t, size_t);
+
+DECLARE_RENDER_PATH(render_samples_float, float)
+DECLARE_RENDER_PATH(render_samples_double, double)
+DECLARE_RENDER_PATH(render_samples_long_double, long double)
+DECLARE_RENDER_PATH(render_samples_q31, int64_t)
+static void render_pcm16_from_double(const struct sound *, uint8_t *, uint64_t,
+                                     size_t);
+static void render_double_enveloped(const struct sound *, double *, uint64_t,
+                                    size_t);
+static void apply_envelope(const struct envelope *, double *, uint64_t,
+                           size_t);
+static struct segment find_segment(const struct envelope *, uint64_t);
+static double segment_level(const struct segment *, enum sound_curve,
+                            uint64_t);
+static void oversample_increments(const struct partial_table *, uint8_t,
+                                  phase_t *);
+static void build_half_band(void);
+static void render_oversampled(const struct sound *, double *, uint64_t, size_t,
+                               void(const struct sound *, const phase_t *,
+                                    double *, uint64_t, size_t));
+static void half_band_scalar(double *, const double *, const double *, size_t);
+#ifdef X86_SINE_KERNELS
+static void half_band_sse2(double *, const double *, const double *, size_t);
+static void half_band_avx2(double *, const double *, const double *, size_t);
+static void half_band_avx512(double *, const double *, const double *, size_t);
+#endif
+static uint64_t find_period(const struct partial_table *);
+static int valid_params(const struct sound_params *);
+static size_t *find_harmonic_stacks(const struct sound *, size_t *);
+static size_t count_unstacked_partials(const struct sound *);
+static uint64_t oscillator_period(phase_t);
+static void select_kernels(void);
+static void sine_kernel_scalar(double *, size_t, phase_t, phase_t, double);
+static void sine_kernel_float_scalar(float *, size_t, phase_t, phase_t,
+                                     double);
+#ifdef X86_SINE_KERNELS
+static void sine_kernel_sse2(double *, size_t, phase_t, phase_t, double);
+static void sine_kernel_avx2(double *, size_t, phase_t, phase_t, double);
+static void sine_kernel_avx512(double *, size_t, phase_t, phase_t, double);
+static void sine_kernel_float_sse2(float *, size_t, phase_t, phase_t, double);
+static void sine_kernel_float_avx2(float *, size_t, phase_t, phase_t, double);
+static void sine_kernel_float_avx512(float *, size_t, phase_t, phase_t,
+                                     double);
+#endif
+static void rotation_kernel_scalar(double *, size_t, phase_t, phase_t,
+                                   double);
+static void rotation_kernel_float_scalar(float *, size_t, phase_t, phase_t,
+                                         double);
+#ifdef X86_SINE_KERNELS
+static void rotation_kernel_sse2(double *, size_t, phase_t, phase_t, double);
+static void rotation_kernel_avx2(double *, size_t, phase_t, phase_t, double);
+static void rotation_kernel_avx512(double *, size_t, phase_t, phase_t,
+                                   double);
+static void rotation_kernel_float_sse2(float *, size_t, phase_t, phase_t,
+                                       double);
+static void rotation_kernel_float_avx2(float *, size_t, phase_t, phase_t,
+                                       double);
+static void rotation_kernel_float_avx512(float *, size_t, phase_t, phase_t,
+                                         double);
+#endif
+static void harmonic_kernel_scalar(double *, size_t, const double *,
+                                   const double *, const double *, size_t);
+#ifdef X86_SINE_KERNELS
+static void harmonic_kernel_sse2(double *, size_t, const double *,
+                                 const double *, const double *, size_t);
+static void harmonic_kernel_avx2(double *, size_t, const double *,
+                                 const double *, const double *, size_t);
+static void harmonic_kernel_avx512(double *, size_t, const double *,
+                                   const double *, const double *, size_t);
+#endif
+static void harmonic_stack_float(float *, size_t, phase_t, phase_t,
+                                 const double *, size_t);
+static void harmonic_stack_double(double *, size_t, phase_t, phase_t,
+                                  const double *, size_t);
+static void harmonic_stack_q31(int64_t *, size_t, phase_t, phase_t,
+                               const double *, size_t);
+static void sine_kernel_reference(long double *, size_t, phase_t, phase_t,
+                                  double);
+static void sine_kernel_q31(int64_t *, size_t, phase_t, phase_t, double);
+static void build_q31_sine(void);
+static inline double sine_polynomial(double);
+static double *const *find_wavetable(enum sound_wave);
+static int build_wavetable(double **, double(phase_t));
+static const double *wavetable_level(const struct sound *, phase_t);
+static void render_wavetable_float(enum sound_wavetable, const double *,
+                                   float *, size_t, phase_t, phase_t, double);
+static void render_wavetable_double(enum sound_wavetable, const double *,
+                                    double *, size_t, phase_t, phase_t,
+                                    double);
+static void render_wavetable_long_double(enum sound_wavetable, const double *,
+                                         long double *, size_t, phase_t,
+                                         phase_t, double);
+static void render_wavetable_q31(enum sound_wavetable, const double *,
+                                 int64_t *, size_t, phase_t, phase_t, double);
+static void build_twiddles(double *, double *, size_t, int);
+static void fft_with_twiddles(double *, double *, size_t, const double *,
+                              const double *);
+static void build_inverse_fft_kernel(void);
+static void synthesize_frame(const struct partial_table *, uint64_t, double *,
+                             double *);
+static void render_inverse_fft(const struct sound *, double *, uint8_t *,
+                               uint64_t, size_t);
+static void render_double_inverse_fft(const struct sound *, double *, uint64_t,
+                                      size_t);
+static void render_pcm16_inverse_fft(const struct sound *, uint8_t *, uint64_t,
+                                     size_t);
+static inline double sine_wave_function(phase_t);
+static inline double square_wave_function(phase_t);
+static inline double triangle_wave_function(phase_t);
+static inline double sawtooth_wave_function(phase_t);
+static inline double point_wave_function(phase_t);
+static inline double circle_wave_function(phase_t);
+static inline double step_residual(phase_t, double);
+static inline double ramp_residual(phase_t, double);
+static inline double polyblep_square_wave_function(phase_t, double);
+static inline double polyblep_sawtooth_wave_function(phase_t, double);
+static inline double polyblep_triangle_wave_function(phase_t, double);
+
+/* Declares the render loops that DEFINE_WAVE_LOOPS() defines for <wave>. */
+#define DECLARE_WAVE_LOOPS(wave)                                               \
+static void wave##_loop_float(float *, size_t, phase_t, phase_t, double);      \
+static void wave##_loop_double(double *, size_t, phase_t, phase_t, double);    \
+static void wave##_loop_long_double(long double *, size_t, phase_t, phase_t,   \
+                                    double);                                   \
+static void wave##_loop_q31(int64_t *, size_t, phase_t, phase_t, double);
+
+DECLARE_WAVE_LOOPS(sine)
+DECLARE_WAVE_LOOPS(square)
+DECLARE_WAVE_LOOPS(triangle)
+DECLARE_WAVE_LOOPS(sawtooth)
+DECLARE_WAVE_LOOPS(point)
+DECLARE_WAVE_LOOPS(circle)
+DECLARE_WAVE_LOOPS(polyblep_square)
+DECLARE_WAVE_LOOPS(polyblep_sawtooth)
+DECLARE_WAVE_LOOPS(polyblep_triangle)
+
+/* The render loops for each wave. */
+#define WAVE_LOOPS(wave) {                                                     \
+    wave##_loop_float, wave##_loop_double, wave##_loop_long_double,            \
+    wave##_loop_q31                                                            \
+}
+static const struct wave_loops sine_wave_loops = WAVE_LOOPS(sine);
+static const struct wave_loops square_wave_loops = WAVE_LOOPS(square);
+static const struct wave_loops triangle_wave_loops = WAVE_LOOPS(triangle);
+static const struct wave_loops sawtooth_wave_loops = WAVE_LOOPS(sawtooth);
+static const struct wave_loops point_wave_loops = WAVE_LOOPS(point);
+static const struct wave_loops circle_wave_loops = WAVE_LOOPS(circle);
+static const struct wave_loops polyblep_square_wave_loops =
+    WAVE_LOOPS(polyblep_square);
+static const struct wave_loops polyblep_sawtooth_wave_loops =
+    WAVE_LOOPS(polyblep_sawtooth);
+static const struct wave_loops polyblep_triangle_wave_loops =
+    WAVE_LOOPS(polyblep_triangle);
+
+/* How to render each enum sound_wave. */
+static const struct wave waves[NUM_WAVES] = {
+    [SOUND_WAVE_SINE] =
+        {sine_wave_function, &sine_wave_loops, SOUND_WAVE_SINE},
+    [SOUND_WAVE_SQUARE] =
+        {square_wave_function, &square_wave_loops, SOUND_WAVE_SQUARE},
+    [SOUND_WAVE_TRIANGLE] =
+        {triangle_wave_function, &triangle_wave_loops, SOUND_WAVE_TRIANGLE},
+    [SOUND_WAVE_SAWTOOTH] =
+        {sawtooth_wave_function, &sawtooth_wave_loops, SOUND_WAVE_SAWTOOTH},
+    [SOUND_WAVE_POINT] =
+        {point_wave_function, &point_wave_loops, SOUND_WAVE_POINT},
+    [SOUND_WAVE_CIRCLE] =
+        {circle_wave_function, &circle_wave_loops, SOUND_WAVE_CIRCLE},
+    [SOUND_WAVE_POLYBLEP_SQUARE] =
+        {square_wave_function, &polyblep_square_wave_loops, SOUND_WAVE_SQUARE},
+    [SOUND_WAVE_POLYBLEP_SAWTOOTH] =
+        {sawtooth_wave_function, &polyblep_sawtooth_wave_loops,
+         SOUND_WAVE_SAWTOOTH},
+    [SOUND_WAVE_POLYBLEP_TRIANGLE] =
+        {triangle_wave_function, &polyblep_triangle_wave_loops,
+         SOUND_WAVE_TRIANGLE}
+};
+
+/**
+ *  The widest polynomial and rotation sine kernels the CPU supports, and the
+ *  widest Chebyshev recurrence and half-band filter. Picked by select_kernels()
+ *  the first time a sound is created.
+ *  Harmonic stacks are seeded from the polynomial kernel whatever the
+ *  enum sound_sine_kernel, since the recurrence needs seeds without the
+ *  rotation kernel's rounding errors.
+**/
+static void (*polynomial_kernel)(double *, size_t, phase_t, phase_t, double) =
+    sine_kernel_scalar;
+static void (*polynomial_kernel_float)(float *, size_t, phase_t, phase_t,
+                                       double) = sine_kernel_float_scalar;
+static void (*rotation_kernel)(double *, size_t, phase_t, phase_t, double) =
+    rotation_kernel_scalar;
+static void (*rotation_kernel_float)(float *, size_t, phase_t, phase_t,
+                                     double) = rotation_kernel_float_scalar;
+static void (*harmonic_kernel)(double *, size_t, const double *,
+                               const double *, const double *, size_t) =
+    harmonic_kernel_scalar;
+static void (*half_band_stage)(double *, const double *, const double *,
+                               size_t) = half_band_scalar;
+static pthread_once_t kernels_selected = PTHREAD_ONCE_INIT;
+
+/* One cycle of a sine wave in Q31, for the Q31 render path. */
+static int32_t q31_sine[Q31_SINE_SIZE + 1];
+static pthread_once_t q31_sine_built = PTHREAD_ONCE_INIT;
+
+/**
+ *  The spectrum of the inverse-FFT engine's window, divided by IFFT_FRAME_SIZE,
+ *  from IFFT_KERNEL_BINS / 2 bins below the window's center frequency to as
+ *  many above it, with a point to spare at the top for interpolation.
+**/
+static double ifft_kernel_re[IFFT_KERNEL_SIZE];
+static double ifft_kernel_im[IFFT_KERNEL_SIZE];
+
+/**
+ *  The weight each of the middle 2 * IFFT_HOP_SIZE samples of an inverse-FFT
+ *  frame is mixed in with: a triangle spanning them, divided by the window.
+**/
+static double ifft_synthesis[2 * IFFT_HOP_SIZE];
+
+/* The twiddle factors of the inverse FFT of a frame, from build_twiddles(). */
+static double ifft_twiddle_re[IFFT_FRAME_SIZE - 1];
+static double ifft_twiddle_im[IFFT_FRAME_SIZE - 1];
+static pthread_once_t ifft_kernel_built = PTHREAD_ONCE_INIT;
+
+/**
+ *  The taps of the half-band filter, from the center out, leaving out the
+ *  center tap of 1/2 and the zeros in between.
+**/
+static double half_band[HALF_BAND_TAPS];
+static pthread_once_t half_band_built = PTHREAD_ONCE_INIT;
+
+/**
+ *  One cycle of each plain wave at each level of detail, from most to fewest
+ *  harmonics, built by find_wavetable() the first time a sound asks for it and
+ *  kept until the process exits. Each level is padded with one point from the
+ *  end of the cycle before it and two from the start after it, so that
+ *  interpolation never has to wrap around.
+**/
+static double *wavetables[NUM_WAVES][WAVETABLE_LEVELS];
+static pthread_mutex_t wavetables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ *  Fills <params> with the defaults of the command line.
+**/
+void sound_default_params(struct sound_params *params) {
+    *params = (struct sound_params){
+        .sample_rate = 44100,
+        .volume = 33.333333,
+        .wave = SOUND_WAVE_SINE,
+        .overtones = 0,
+        .wavetable = SOUND_WAVETABLE_OFF,
+        .sine_kernel = SOUND_SINE_ROTATION,
+        .precision = SOUND_PRECISION_FLOAT,
+        .additive = SOUND_ADDITIVE_AUTO,
+        .oversample = 1,
+        .attack = 0,
+        .decay = 0,
+        .sustain = 100,
+        .release = 0,
+        .curve = SOUND_CURVE_LINEAR,
+        .length = 0,
+        .num_frequencies = 0,
+        .frequencies = NULL
+    };
+}
+
+/**
+ *  Returns a new sound described by <params>, or NULL with errno set to EINVAL
+ *  or ENOMEM. It has room for just the partials it needs.
+**/
+struct sound *sound_create(const struct sound_params *params) {
+    if(!valid_params(params)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t per_frequency = (size_t)params->overtones + 1;
+    if(params->num_frequencies > SIZE_MAX / per_frequency) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct sound *sound = sound_reserve(per_frequency *
+                                        params->num_frequencies);
+    if(!sound || sound_reset(sound, params)) {
+        int error = errno;
+        sound_destroy(sound);
+        errno = error;
+        return NULL;
+    }
+    return sound;
+}
+
+/**
+ *  Returns a new sound with room for <max_partials> partials, or NULL with
+ *  errno set to EINVAL if <max_partials> is 0, or ENOMEM. It has to be given
+ *  a sound to make with sound_reset() before it's rendered.
+**/
+struct sound *sound_reserve(size_t max_partials) {
+    if(!max_partials) {
+        errno = EINVAL;
+        return NULL;
+    } else if(max_partials > SIZE_MAX / sizeof(long double)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_once(&kernels_selected, select_kernels);
+    struct sound *sound = calloc(1, sizeof(*sound));
+    if(!sound || init_partial_table(&sound->partials, max_partials) ||
+       !(sound->stack_room = malloc(max_partials *
+                                    sizeof(*sound->stack_room))) ||
+       !(sound->increment_room = malloc(max_partials *
+                                        sizeof(*sound->increment_room)))) {
+        sound_destroy(sound);
+        errno = ENOMEM;
+        return NULL;
+    }
+    sound->capacity = max_partials;
+    return sound;
+}
+
+/**
+ *  Makes <sound> into the one described by <params>, at the start of every
+ *  cycle, in the room it already has. Returns 0, or -1 with errno set to
+ *  EINVAL if <params> don't describe a sound, or ENOMEM if it needs more
+ *  partials than <sound> has room for or its wavetable couldn't be built,
+ *  leaving <sound> as it was.
+ *  Everything about how the sound is rendered is settled here: the tables it
+ *  needs are built, and the render paths that will use them picked, so that
+ *  rendering never has to allocate or wait on a lock. Only the first sound of
+ *  each wave to use a wavetable allocates anything here.
+**/
+int sound_reset(struct sound *sound, const struct sound_params *params) {
+    if(!valid_params(params)) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t per_frequency = (size_t)params->overtones + 1;
+    if(params->num_frequencies > sound->capacity / per_frequency) {
+        errno = ENOMEM;
+        return -1;
+    }
+    const struct wave *wave = &waves[params->wave];
+    double *const *wavetable = NULL;
+    if(params->wavetable != SOUND_WAVETABLE_OFF &&
+       !(wavetable = find_wavetable(wave->plain))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    sound->partials.size = per_frequency * params->num_frequencies;
+    double gain = ((params->volume / 100) * INT16_MAX) / sound->partials.size;
+    for(size_t p = 0; p < params->num_frequencies; p++) {
+        for(size_t o = 0; o < per_frequency; o++) {
+            set_partial(&sound->partials, p * per_frequency + o,
+                        (o + 1) * params->frequencies[p], gain,
+                        params->sample_rate);
+        }
+    }
+
+    uint8_t rotate = params->sine_kernel == SOUND_SINE_ROTATION;
+    sound->wave_function = wave->function;
+    sound->wave_loops = wave->loops;
+    sound->wavetable_mode = params->wavetable;
+    sound->wavetable = wavetable;
+    sound->sine_kernel = rotate ? rotation_kernel : polynomial_kernel;
+    sound->sine_kernel_float = rotate ? rotation_kernel_float :
+                                        polynomial_kernel_float;
+    sound->stacks = find_harmonic_stacks(sound, sound->stack_room);
+    sound->oversample = 1;
+    sound->oversampled_increments = NULL;
+
+    switch(params->precision) {
+        case SOUND_PRECISION_FLOAT:
+            sound->render_pcm16 = render_samples_float;
+            sound->render_double = render_samples_float_double;
+            break;
+        case SOUND_PRECISION_DOUBLE:
+            sound->render_pcm16 = render_samples_double;
+            sound->render_double = render_samples_double_double;
+            break;
+        case SOUND_PRECISION_LONG_DOUBLE:
+            sound->render_pcm16 = render_samples_long_double;
+            sound->render_double = render_samples_long_double_double;
+            break;
+        case SOUND_PRECISION_Q31:
+            pthread_once(&q31_sine_built, build_q31_sine);
+            sound->render_pcm16 = render_samples_q31;
+            sound->render_double = render_samples_q31_double;
+            break;
+    }
+    if(params->additive == SOUND_ADDITIVE_INVERSE_FFT ||
+       (params->additive == SOUND_ADDITIVE_AUTO &&
+        (params->precision == SOUND_PRECISION_FLOAT ||
+         params->precision == SOUND_PRECISION_DOUBLE) &&
+        count_unstacked_partials(sound) >= IFFT_THRESHOLD)) {
+        pthread_once(&ifft_kernel_built, build_inverse_fft_kernel);
+        sound->render_pcm16 = render_pcm16_inverse_fft;
+        sound->render_double = render_double_inverse_fft;
+    } else if(params->oversample > 1) {
+        sound->oversample = params->oversample;
+        oversample_increments(&sound->partials, params->oversample,
+                              sound->increment_room);
+        sound->oversampled_increments = sound->increment_room;
+        pthread_once(&half_band_built, build_half_band);
+        sound->render_pcm16 = render_pcm16_from_double;
+    }
+
+    struct envelope *envelope = &sound->envelope;
+    uint64_t rate = params->sample_rate;
+    uint64_t release = (uint64_t)params->release * rate / 1000;
+    envelope->attack_end = (uint64_t)params->attack * rate / 1000;
+    envelope->decay_end = envelope->attack_end +
+                          (uint64_t)params->decay * rate / 1000;
+    envelope->end = params->length;
+    envelope->release_start = (params->length > release) ?
+                              params->length - release : 0;
+    // A release can't start before the attack is over, or a note shorter than
+    // its release would fade from silence to silence. It's shortened instead,
+    // to start halfway through a note too short to finish its attack first.
+    if(envelope->end && envelope->release_start < envelope->attack_end) {
+        envelope->release_start = (envelope->attack_end < envelope->end / 2) ?
+                                  envelope->attack_end : envelope->end / 2;
+    }
+    envelope->sustain = params->sustain / 100;
+    envelope->curve = params->curve;
+    sound->enveloped = envelope->decay_end || params->sustain < 100 ||
+                       (envelope->end && release);
+    if(sound->enveloped) {
+        sound->render_unshaped = sound->render_double;
+        sound->render_double = render_double_enveloped;
+        sound->render_pcm16 = render_pcm16_from_double;
+    }
+    sound->position = 0;
+    return 0;
+}
+
+/**
+ *  Returns whether <params> describe a sound.
+**/
+static int valid_params(const struct sound_params *params) {
+    if(!params->sample_rate || !(params->volume > 0) || params->volume > 100 ||
+       (unsigned)params->wave >= NUM_WAVES ||
+       (unsigned)params->wavetable > SOUND_WAVETABLE_CUBIC ||
+       (unsigned)params->sine_kernel > SOUND_SINE_ROTATION ||
+       (unsigned)params->precision > SOUND_PRECISION_Q31 ||
+       (unsigned)params->additive > SOUND_ADDITIVE_INVERSE_FFT ||
+       (params->oversample != 1 && params->oversample != 2 &&
+        params->oversample != 4 && params->oversample != 8) ||
+       !(params->sustain >= 0) || params->sustain > 100 ||
+       (unsigned)params->curve > SOUND_CURVE_EXPONENTIAL ||
+       !params->num_frequencies ||
+       (params->additive == SOUND_ADDITIVE_INVERSE_FFT &&
+        (params->wave != SOUND_WAVE_SINE ||
+         params->wavetable != SOUND_WAVETABLE_OFF))) {
+        return 0;
+    }
+    for(size_t p = 0; p < params->num_frequencies; p++) {
+        if(!(params->frequencies[p] > 0) || isinf(params->frequencies[p])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ *  Frees <sound>, if it isn't NULL. Its wavetable belongs to every sound of
+ *  the same wave, and stays.
+**/
+void sound_destroy(struct sound *sound) {
+    if(!sound) {
+        return;
+    }
+    free_partial_table(&sound->partials);
+    free(sound->stack_room);
+    free(sound->increment_room);
+    free(sound);
+}
+
+/**
+ *  Renders the next <frames> samples of <sound> into <buffer>,
+ *  RENDER_BLOCK_SIZE at a time, then moves the sound past them.
+**/
+void sound_render(struct sound *sound, float *buffer, size_t frames) {
+    double block[RENDER_BLOCK_SIZE];
+    for(size_t done = 0; done < frames; done += RENDER_BLOCK_SIZE) {
+        size_t size = (frames - done < RENDER_BLOCK_SIZE) ?
+                      frames - done : RENDER_BLOCK_SIZE;
+        sound->render_double(sound, block, done, size);
+        for(size_t i = 0; i < size; i++) {
+            buffer[done + i] = (float)(block[i] / INT16_MAX);
+        }
+    }
+    sound_advance(sound, frames);
+}
+
+/**
+ *  Renders the next <frames> samples of <sound> into <buffer> with its own
+ *  render path, in 16-bit steps, then moves the sound past them.
+**/
+void sound_render_steps(struct sound *sound, double *buffer, size_t frames) {
+    for(size_t done = 0; done < frames; done += RENDER_BLOCK_SIZE) {
+        size_t size = (frames - done < RENDER_BLOCK_SIZE) ?
+                      frames - done : RENDER_BLOCK_SIZE;
+        sound->render_double(sound, buffer + done, done, size);
+    }
+    sound_advance(sound, frames);
+}
+
+/**
+ *  Renders <frames> samples of <sound> as 16-bit little-endian PCM into
+ *  <bytes>, beginning <start> samples after the current phase of each of its
+ *  partials. The partials themselves are left untouched, so any number of
+ *  threads may render from them at once.
+**/
+void sound_render_pcm16(const struct sound *sound, uint8_t *bytes,
+                        uint64_t start, size_t frames) {
+    sound->render_pcm16(sound, bytes, start, frames);
+}
+
+/**
+ *  Moves every partial of <sound> <frames> samples further along its cycle.
+ *  An oversampled sound moves by the increments it's rendered with, which are
+ *  rounded down, so that it lands exactly where rendering further would have.
+**/
+void sound_advance(struct sound *sound, uint64_t frames) {
+    struct partial_table *partials = &sound->partials;
+    sound->position += frames;
+    for(size_t o = 0; o < partials->size; o++) {
+        partials->phase[o] += sound->oversampled_increments ?
+            frames * sound->oversample * sound->oversampled_increments[o] :
+            frames * partials->increment[o];
+    }
+}
+
+/**
+ *  Returns the number of samples after which <sound> repeats itself, or 0 if
+ *  that takes more than MAX_TILE_PERIOD samples or its envelope keeps it from
+ *  repeating at all.
+**/
+uint64_t sound_period(const struct sound *sound) {
+    return sound->enveloped ? 0 : find_period(&sound->partials);
+}
+
+/**
+ *  Returns the level of the envelope of <sound> where it is now, from 0 to 1.
+**/
+double sound_envelope_level(const struct sound *sound) {
+    if(!sound->enveloped) {
+        return 1;
+    }
+    uint64_t position = sound->position;
+    if(sound->envelope.end && position >= sound->envelope.end) {
+        return 0;
+    }
+    struct segment segment = find_segment(&sound->envelope, position);
+    return segment_level(&segment, sound->envelope.curve, position);
+}
+
+/**
+ *  Allocates room in <table> for <size> partials. There is no limit on <size>
+ *  beyond available memory; each array is aligned to CACHE_LINE_SIZE.
+ *  Returns 0, or -1 if memory ran out, leaving whatever could be allocated for
+ *  free_partial_table() to free.
+**/
+static int init_partial_table(struct partial_table *table, size_t size) {
+    table->size = size;
+    table->frequency = aligned_malloc(size * sizeof(*table->frequency));
+    table->phase = aligned_malloc(size * sizeof(*table->phase));
+    table->increment = aligned_malloc(size * sizeof(*table->increment));
+    table->gain = aligned_malloc(size * sizeof(*table->gain));
+    return (table->frequency && table->phase && table->increment &&
+            table->gain) ? 0 : -1;
+}
+
+/**
+ *  Sets up partial <index> of <table> to produce a wave of the given
+ *  <frequency> and <gain> at <sample_rate>, starting at the beginning of its
+ *  cycle.
+ *  The increment is rounded up so that the accumulated phase never falls
+ *  behind the exact one; this keeps the discontinuities of the square and
+ *  circle waves landing on the same samples as an exact computation would.
+**/
+static void set_partial(struct partial_table *table, size_t index,
+                        long double frequency, double gain,
+                        uint32_t sample_rate) {
+    long double cycles = frequency / sample_rate;
+    long double increment = ceill(ldexpl(cycles - floorl(cycles), 64));
+    table->frequency[index] = frequency;
+    table->phase[index] = 0;
+    table->increment[index] = (increment < ldexpl(1, 64)) ?
+                              (phase_t)increment : 0;
+    table->gain[index] = gain;
+}
+
+/**
+ *  Frees the arrays of <table>, leaving it empty.
+**/
+static void free_partial_table(struct partial_table *table) {
+    free(table->frequency);
+    free(table->phase);
+    free(table->increment);
+    free(table->gain);
+    *table = (struct partial_table){0};
+}
+
+/**
+ *  Returns <size> bytes aligned to CACHE_LINE_SIZE, or NULL if memory ran out.
+**/
+static void *aligned_malloc(size_t size) {
+    void *memory;
+    return posix_memalign(&memory, CACHE_LINE_SIZE, size) ? NULL : memory;
+}
+
+/**
+ *  Defines a render path that mixes samples as <type>, in which one 16-bit
+ *  step is <unit>, using <sine> for sine waves, <stack> for harmonic stacks of
+ *  them (if not NULL), <reader> for wavetables and the <loop> of the sound's
+ *  wave_loops for everything else.
+ *  The path renders <n> samples of <sound>, beginning <start> samples after
+ *  the current phase of each of its partials: name() as 16-bit little-endian
+ *  PCM into <bytes>, and name_double() as doubles into <out>. The partials
+ *  themselves are left untouched, so any number of threads may render from
+ *  them at once.
+ *  Samples are mixed RENDER_BLOCK_SIZE at a time by name_mix(), with the
+ *  partials advancing by the given <increments> each sample, then clamped to
+ *  the 16-bit range, since band-limited waves can overshoot their analytic
+ *  peaks. An oversampled sound is mixed by name_mix_double() instead, and
+ *  handed to render_oversampled() to be brought down to the sample rate.
+**/
+#define DEFINE_RENDER_PATH(name, type, unit, sine, stack, reader, loop)        \
+static void name##_mix(const struct sound *sound, const phase_t *increments,   \
+                       type *block, uint64_t start, size_t size) {             \
+    void (*const harmonics)(type *, size_t, phase_t, phase_t, const double *,  \
+                            size_t) = (stack);                                 \
+    const struct partial_table *partials = &sound->partials;                   \
+    for(size_t o = 0; o < partials->size; o++) {                               \
+        phase_t increment = increments[o];                                     \
+        phase_t phase = partials->phase[o] + start * increment;                \
+        double gain = partials->gain[o];                                       \
+        if(sound->wavetable_mode != SOUND_WAVETABLE_OFF) {                     \
+            const double *table = wavetable_level(sound, increment);           \
+            if(table) {                                                        \
+                reader(sound->wavetable_mode, table, block, size, phase,       \
+                       increment, gain);                                       \
+            }                                                                  \
+            continue;                                                          \
+        }                                                                      \
+        if(harmonics && sound->stacks &&                                       \
+           sound->stacks[o] >= MIN_HARMONIC_STACK) {                           \
+            harmonics(block, size, phase, increment, partials->gain + o,       \
+                      sound->stacks[o]);                                       \
+            o += sound->stacks[o] - 1;                                         \
+            continue;                                                          \
+        }                                                                      \
+        if(sound->wave_function == sine_wave_function) {                       \
+            sine(block, size, phase, increment, gain);                         \
+            continue;                                                          \
+        }                                                                      \
+        sound->wave_loops->loop(block, size, phase, increment, gain);          \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void name##_mix_double(const struct sound *sound,                       \
+                              const phase_t *increments, double *out,          \
+                              uint64_t start, size_t n) {                      \
+    type block[RENDER_BLOCK_SIZE];                                             \
+    for(size_t done = 0; done < n; done += RENDER_BLOCK_SIZE) {                \
+        size_t size = (n - done < RENDER_BLOCK_SIZE) ?                         \
+                      n - done : RENDER_BLOCK_SIZE;                            \
+        memset(block, 0, size * sizeof(*block));                               \
+        name##_mix(sound, increments, block, start + done, size);              \
+        for(size_t i = 0; i < size; i++) {                                     \
+            out[done + i] = (double)block[i] / (unit);                         \
+        }                                                                      \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void name##_double(const struct sound *sound, double *out,              \
+                          uint64_t start, size_t n) {                          \
+    if(sound->oversampled_increments) {                                        \
+        render_oversampled(sound, out, start, n, name##_mix_double);           \
+    } else {                                                                   \
+        name##_mix_double(sound, sound->partials.increment, out, start, n);    \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void name(const struct sound *sound, uint8_t *bytes, uint64_t start,    \
+                 size_t n) {                                                   \
+    type block[RENDER_BLOCK_SIZE];                                             \
+    for(size_t done = 0; done < n; done += RENDER_BLOCK_SIZE) {                \
+        size_t size = (n - done < RENDER_BLOCK_SIZE) ?                         \
+                      n - done : RENDER_BLOCK_SIZE;                            \
+        memset(block, 0, size * sizeof(*block));                               \
+        name##_mix(sound, sound->partials.increment, block, start + done,      \
+                   size);                                                      \
+        const type high = INT16_MAX * (type)(unit);                            \
+        const type low = INT16_MIN * (type)(unit);                             \
+        for(size_t i = 0; i < size; i++) {                                     \
+            type clamped = (block[i] > high) ? high :                          \
+                           (block[i] < low) ? low : block[i];                  \
+            uint16_t sample = (uint16_t)(int16_t)(clamped / (unit));           \
+            bytes[2 * (done + i)] = sample & UCHAR_MAX;                        \
+            bytes[2 * (done + i) + 1] = sample >> CHAR_BIT;                    \
+        }                                                                      \
+    }                                                                          \
+}
+
+DEFINE_RENDER_PATH(render_samples_float, float, 1, sound->sine_kernel_float,
+                   harmonic_stack_float, render_wavetable_float, float_loop)
+DEFINE_RENDER_PATH(render_samples_double, double, 1, sound->sine_kernel,
+                   harmonic_stack_double, render_wavetable_double, double_loop)
+DEFINE_RENDER_PATH(render_samples_long_double, long double, 1,
+                   sine_kernel_reference, NULL, render_wavetable_long_double,
+                   long_double_loop)
+DEFINE_RENDER_PATH(render_samples_q31, int64_t, Q31_MIX_UNIT, sine_kernel_q31,
+                   harmonic_stack_q31, render_wavetable_q31, q31_loop)
+
+/**
+ *  Renders <n> samples of <sound> as 16-bit little-endian PCM into <bytes>,
+ *  beginning <start> samples after the current phase of each of its partials,
+ *  from the doubles of its render_double(), clamped to the 16-bit range.
+**/
+static void render_pcm16_from_double(const struct sound *sound, uint8_t *bytes,
+                                     uint64_t start, size_t n) {
+    double block[RENDER_BLOCK_SIZE];
+    for(size_t done = 0; done < n; done += RENDER_BLOCK_SIZE) {
+        size_t size = (n - done < RENDER_BLOCK_SIZE) ?
+                      n - done : RENDER_BLOCK_SIZE;
+        sound->render_double(sound, block, start + done, size);
+        for(size_t i = 0; i < size; i++) {
+            double clamped = (block[i] > INT16_MAX) ? INT16_MAX :
+                             (block[i] < INT16_MIN) ? INT16_MIN : block[i];
+            uint16_t sample = (uint16_t)(int16_t)clamped;
+            bytes[2 * (done + i)] = sample & UCHAR_MAX;
+            bytes[2 * (done + i) + 1] = sample >> CHAR_BIT;
+        }
+    }
+}
+
+/**
+ *  Renders <n> samples of <sound> as doubles into <out>, beginning <start>
+ *  samples after where it is now, with the render path the envelope replaced,
+ *  then applies the envelope.
+**/
+static void render_double_enveloped(const struct sound *sound, double *out,
+                                    uint64_t start, size_t n) {
+    sound->render_unshaped(sound, out, start, n);
+    apply_envelope(&sound->envelope, out, sound->position + start, n);
+}
+
+/**
+ *  Scales the <size> samples of <block>, which begin <position> samples into
+ *  the sound, by <envelope>.
+ *  The level is worked out exactly at the first sample, at the start of each
+ *  segment and every RENDER_BLOCK_SIZE samples from the start of the sound,
+ *  and carried along in between: by adding a step for linear segments, and by
+ *  multiplying its distance from where the segment heads by a ratio for
+ *  exponential ones. That takes no more than two calls to pow() per block,
+ *  and since those points don't depend on where <block> begins, a sample
+ *  comes out the same however the sound is split up to be rendered.
+**/
+static void apply_envelope(const struct envelope *envelope, double *block,
+                           uint64_t position, size_t size) {
+    for(size_t i = 0; i < size;) {
+        uint64_t p = position + i;
+        if(envelope->end && p >= envelope->end) {
+            memset(block + i, 0, (size - i) * sizeof(*block));
+            return;
+        }
+        struct segment segment = find_segment(envelope, p);
+        uint64_t stop = (p / RENDER_BLOCK_SIZE + 1) * RENDER_BLOCK_SIZE;
+        if(segment.last < stop) {
+            stop = segment.last;
+        }
+        size_t count = (stop - p < size - i) ? stop - p : size - i;
+        double level = segment_level(&segment, envelope->curve, p);
+        if(segment.from == segment.to) {
+            for(size_t j = i; j < i + count; j++) {
+                block[j] *= level;
+            }
+        } else if(envelope->curve == SOUND_CURVE_LINEAR) {
+            double step = (segment.to - segment.from) /
+                          (segment.last - segment.first);
+            for(size_t j = i; j < i + count; j++) {
+                block[j] *= level;
+                level += step;
+            }
+        } else {
+            double target = segment.to + (segment.to - segment.from) *
+                                         ENVELOPE_OVERSHOOT;
+            double ratio = pow(ENVELOPE_OVERSHOOT / (1 + ENVELOPE_OVERSHOOT),
+                               1.0 / (segment.last - segment.first));
+            double distance = level - target;
+            for(size_t j = i; j < i + count; j++) {
+                block[j] *= target + distance;
+                distance *= ratio;
+            }
+        }
+        i += count;
+    }
+}
+
+/**
+ *  Returns the segment of <envelope> that sample <position>, before its end,
+ *  falls in. The sustain counts as a segment that stays level until the
+ *  release, or forever if there is none.
+**/
+static struct segment find_segment(const struct envelope *envelope,
+                                   uint64_t position) {
+    if(envelope->end && position >= envelope->release_start) {
+        struct envelope held = *envelope;
+        held.end = 0;
+        struct segment before = find_segment(&held, envelope->release_start);
+        return (struct segment){
+            .first = envelope->release_start,
+            .last = envelope->end,
+            .from = segment_level(&before, envelope->curve,
+                                  envelope->release_start),
+            .to = 0
+        };
+    } else if(position < envelope->attack_end) {
+        return (struct segment){0, envelope->attack_end, 0, 1};
+    } else if(position < envelope->decay_end) {
+        return (struct segment){envelope->attack_end, envelope->decay_end, 1,
+                                envelope->sustain};
+    }
+    return (struct segment){
+        .first = envelope->decay_end,
+        .last = envelope->end ? envelope->release_start : UINT64_MAX,
+        .from = envelope->sustain,
+        .to = envelope->sustain
+    };
+}
+
+/**
+ *  Returns the level of <segment> at sample <position>, following <curve>.
+**/
+static double segment_level(const struct segment *segment,
+                            enum sound_curve curve, uint64_t position) {
+    if(segment->from == segment->to || position <= segment->first) {
+        return segment->from;
+    }
+    double progress = (double)(position - segment->first) /
+                      (segment->last - segment->first);
+    if(curve == SOUND_CURVE_LINEAR) {
+        return segment->from + (segment->to - segment->from) * progress;
+    }
+    double target = segment->to + (segment->to - segment->from) *
+                                  ENVELOPE_OVERSHOOT;
+    return target + (segment->from - target) *
+                    pow(ENVELOPE_OVERSHOOT / (1 + ENVELOPE_OVERSHOOT),
+                        progress);
+}
+
+/**
+ *  Fills <increments> with those of <partials> at <oversample> times the
+ *  sample rate.
+**/
+static void oversample_increments(const struct partial_table *partials,
+                                  uint8_t oversample, phase_t *increments) {
+    for(size_t o = 0; o < partials->size; o++) {
+        increments[o] = partials->increment[o] / oversample;
+    }
+}
+
+/**
+ *  Fills in <half_band> with a windowed sinc: cut off at a quarter of the rate
+ *  it filters, under a Kaiser window with beta 10. It passes up to 0.4 of the
+ *  rate it decimates to within 0.001 dB, and stops 0.6 of it and beyond by at
+ *  least 98 dB, so whatever folds back lands above 0.4 of it, 98 dB down.
+**/
+static void build_half_band(void) {
+    const double beta = 10;
+    double total = 0;
+    for(int j = 0; j < HALF_BAND_TAPS; j++) {
+        double d = 2 * j + 1;
+        double r = d / (HALF_BAND_REACH + 1);
+        // I0(), the modified Bessel function of the first kind, by its series.
+        double x = beta * sqrt(1 - r * r), window = 1, term = 1;
+        double scale = 1, term_scale = 1;
+        for(int k = 1; k < 50; k++) {
+            term *= (x / (2 * k)) * (x / (2 * k));
+            term_scale *= (beta / (2 * k)) * (beta / (2 * k));
+            window += term;
+            scale += term_scale;
+        }
+        half_band[j] = sin(PI * d / 2) / (PI * d) * window / scale;
+        total += half_band[j];
+    }
+    // The taps on both sides plus the center tap of 1/2 should pass DC as is.
+    for(int j = 0; j < HALF_BAND_TAPS; j++) {
+        half_band[j] *= 0.25 / total;
+    }
+}
+
+/**
+ *  Renders <n> samples of <sound> as doubles into <out>, beginning <start>
+ *  samples after the current phase of each of its partials, by mixing them at
+ *  its oversample times the sample rate with <mix> and halving the rate with
+ *  the half-band filter until it's back down.
+ *  Each output sample is lined up with the oversampled sample at the same
+ *  phase, and the filter reaches HALF_BAND_REACH samples either side of it, so
+ *  every stage mixes or keeps that many more than it passes on. Nothing is
+ *  carried over between calls, so chunks can still be rendered in any order,
+ *  at the cost of mixing those margins again for every OVERSAMPLE_BLOCK_SIZE
+ *  samples.
+**/
+static void render_oversampled(const struct sound *sound, double *out,
+                               uint64_t start, size_t n,
+                               void (*mix)(const struct sound *,
+                                           const phase_t *, double *,
+                                           uint64_t, size_t)) {
+    double buffer[2][OVERSAMPLE_BUFFER_SIZE];
+    double even[OVERSAMPLE_BUFFER_SIZE / 2 + 1];
+    double odd[OVERSAMPLE_BUFFER_SIZE / 2 + 1];
+    int stages = 0;
+    while((1 << stages) < sound->oversample) {
+        stages++;
+    }
+    for(size_t done = 0; done < n; done += OVERSAMPLE_BLOCK_SIZE) {
+        size_t size = (n - done < OVERSAMPLE_BLOCK_SIZE) ?
+                      n - done : OVERSAMPLE_BLOCK_SIZE;
+        // Work back from the samples wanted to the oversampled ones needed.
+        size_t count[MAX_OVERSAMPLE];
+        uint64_t first = start + done;
+        count[stages] = size;
+        for(int s = stages; s > 0; s--) {
+            first = 2 * first - HALF_BAND_REACH;
+            count[s - 1] = 2 * count[s] - 1 + 2 * HALF_BAND_REACH;
+        }
+        double *in = buffer[0], *filtered = buffer[1];
+        mix(sound, sound->oversampled_increments, in, first, count[0]);
+        for(int s = 0; s < stages; s++) {
+            for(size_t i = 0; i < count[s]; i++) {
+                ((i & 1) ? odd : even)[i / 2] = in[i];
+            }
+            half_band_stage(filtered, even, odd, count[s + 1]);
+            double *t = in;
+            in = filtered;
+            filtered = t;
+        }
+        memcpy(out + done, in, size * sizeof(*out));
+    }
+}
+
+/**
+ *  Writes <n> samples to <out>, each filtered from the input split between
+ *  <even> and <odd> samples and taken at half its rate. Output sample m is
+ *  centered on input sample 2m + HALF_BAND_REACH, which is odd, so it takes
+ *  the center tap from <odd> and all of the others from <even>: the polyphase
+ *  form of a half-band filter, which never multiplies by its zeros.
+**/
+static void half_band_scalar(double *out, const double *even, const double *odd,
+                             size_t n) {
+    for(size_t m = 0; m < n; m++) {
+        double acc = 0.5 * odd[m + HALF_BAND_TAPS - 1];
+        for(int j = 0; j < HALF_BAND_TAPS; j++) {
+            acc += half_band[j] * (even[m + HALF_BAND_TAPS - 1 - j] +
+                                   even[m + HALF_BAND_TAPS + j]);
+        }
+        out[m] = acc;
+    }
+}
+
+#ifdef X86_SINE_KERNELS
+/**
+ *  Defines a version of the scalar half-band filter that works on <lanes>
+ *  output samples at once, for the given <isa>. The polyphase split leaves
+ *  every tap reading consecutive inputs for consecutive outputs.
+**/
+#define DEFINE_HALF_BAND(name, isa, lanes)                                     \
+__attribute__((target(isa)))                                                   \
+static void name(double *out, const double *even, const double *odd,           \
+                 size_t n) {                                                   \
+    typedef double vec __attribute__((vector_size((lanes) * sizeof(*out))));   \
+    size_t m = 0;                                                              \
+    for(; m + (lanes) <= n; m += (lanes)) {                                    \
+        vec acc, below, above;                                                 \
+        memcpy(&acc, odd + m + HALF_BAND_TAPS - 1, sizeof(vec));               \
+        acc *= 0.5;                                                            \
+        for(int j = 0; j < HALF_BAND_TAPS; j++) {                              \
+            memcpy(&below, even + m + HALF_BAND_TAPS - 1 - j, sizeof(vec));    \
+            memcpy(&above, even + m + HALF_BAND_TAPS + j, sizeof(vec));        \
+            acc += half_band[j] * (below + above);                             \
+        }                                                                      \
+        memcpy(out + m, &acc, sizeof(vec));                                    \
+    }                                                                          \
+    for(; m < n; m++) {                                                        \
+        double acc = 0.5 * odd[m + HALF_BAND_TAPS - 1];                        \
+        for(int j = 0; j < HALF_BAND_TAPS; j++) {                              \
+            acc += half_band[j] * (even[m + HALF_BAND_TAPS - 1 - j] +          \
+                                   even[m + HALF_BAND_TAPS + j]);              \
+        }                                                                      \
+        out[m] = acc;                                                          \
+    }                                                                          \
+}
+
+DEFINE_HALF_BAND(half_band_sse2, "sse2", 2)
+DEFINE_HALF_BAND(half_band_avx2, "avx2,fma", 4)
+DEFINE_HALF_BAND(half_band_avx512, "avx512f", 8)
+#endif
+
+/**
+ *  Returns the number of samples after which all of <partials> are back where
+ *  they started, or 0 if that takes more than MAX_TILE_PERIOD samples.
+**/
+static uint64_t find_period(const struct partial_table *partials) {
+    uint64_t period = 1;
+    for(size_t o = 0; o < partials->size; o++) {
+        uint64_t own_period = oscillator_period(partials->increment[o]);
+        if(!own_period) {
+            return 0;
+        }
+        uint64_t a = period, b = own_period;
+        while(b) {
+            uint64_t r = a % b;
+            a = b;
+            b = r;
+        }
+        period = period / a * own_period;
+        if(period > MAX_TILE_PERIOD) {
+            return 0;
+        }
+    }
+    return period;
+}
+
+/**
+ *  Fills <stacks> with, for each of the partials of <sound>, the number of
+ *  partials in the harmonic stack that begins with it: those right after it
+ *  whose frequencies are 2, 3, 4, ... times its own, as --overtones lays them
+ *  out. Partials inside a stack are counted as stacks of one. Returns
+ *  <stacks>, or NULL if <sound> doesn't render sine waves that the render
+ *  paths could stack.
+**/
+static size_t *find_harmonic_stacks(const struct sound *sound,
+                                    size_t *stacks) {
+    const struct partial_table *partials = &sound->partials;
+    if(sound->wave_function != sine_wave_function ||
+       sound->wavetable_mode != SOUND_WAVETABLE_OFF) {
+        return NULL;
+    }
+    for(size_t o = 0; o < partials->size;) {
+        size_t count = 1;
+        while(o + count < partials->size &&
+              partials->frequency[o + count] ==
+              (count + 1) * partials->frequency[o]) {
+            count++;
+        }
+        stacks[o] = count;
+        for(size_t k = 1; k < count; k++) {
+            stacks[o + k] = 1;
+        }
+        o += count;
+    }
+    return stacks;
+}
+
+/**
+ *  Returns the number of partials of <sound> that aren't in harmonic stacks
+ *  the render paths would take together, or 0 if it has no stacks to count.
+**/
+static size_t count_unstacked_partials(const struct sound *sound) {
+    const size_t *stacks = sound->stacks;
+    if(!stacks) {
+        return 0;
+    }
+    size_t count = 0;
+    for(size_t o = 0; o < sound->partials.size; o += stacks[o]) {
+        if(stacks[o] < MIN_HARMONIC_STACK) {
+            count += stacks[o];
+        }
+    }
+    return count;
+}
+
+/**
+ *  Returns the smallest number of samples, up to MAX_TILE_PERIOD, after which
+ *  an oscillator advancing by <increment> is back where it started, or 0 if
+ *  there is none.
+ *  Increments are rounded from the exact frequency, so a period is accepted
+ *  when it lands within one unit of phase per sample of the start; dropping
+ *  that error is exactly what an exact computation would do. The candidates
+ *  are the denominators of the convergents of the continued fraction of
+ *  <increment> / 2^64, since any period this short must be one of them.
+**/
+static uint64_t oscillator_period(phase_t increment) {
+    if(!increment) {
+        return 1;
+    }
+    // Euclid's algorithm on 2^64 and <increment>, whose first step has to
+    // work around 2^64 not fitting in a uint64_t.
+    uint64_t quotient = UINT64_MAX / increment;
+    uint64_t remainder = UINT64_MAX % increment + 1;
+    if(remainder == increment) {
+        quotient++;
+        remainder = 0;
+    }
+    uint64_t divisor = increment;
+    uint64_t previous = 0, period = 1;
+    for(;;) {
+        if(quotient > MAX_TILE_PERIOD ||
+           quotient * period + previous > MAX_TILE_PERIOD) {
+            return 0;
+        }
+        uint64_t next = quotient * period + previous;
+        previous = period;
+        period = next;
+        phase_t error = period * increment;
+        if(error < period || -error < period) {
+            return period;
+        }
+        if(!remainder) {
+            return 0;
+        }
+        quotient = divisor / remainder;
+        uint64_t r = divisor % remainder;
+        divisor = remainder;
+        remainder = r;
+    }
+}
+
+/**
+ *  Picks the widest implementation of each vector kernel that the CPU
+ *  supports.
+**/
+static void select_kernels(void) {
+#ifdef X86_SINE_KERNELS
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        polynomial_kernel = sine_kernel_avx512;
+        polynomial_kernel_float = sine_kernel_float_avx512;
+        rotation_kernel = rotation_kernel_avx512;
+        rotation_kernel_float = rotation_kernel_float_avx512;
+        harmonic_kernel = harmonic_kernel_avx512;
+        half_band_stage = half_band_avx512;
+    } else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        polynomial_kernel = sine_kernel_avx2;
+        polynomial_kernel_float = sine_kernel_float_avx2;
+        rotation_kernel = rotation_kernel_avx2;
+        rotation_kernel_float = rotation_kernel_float_avx2;
+        harmonic_kernel = harmonic_kernel_avx2;
+        half_band_stage = half_band_avx2;
+    } else if(__builtin_cpu_supports("sse2")) {
+        polynomial_kernel = sine_kernel_sse2;
+        polynomial_kernel_float = sine_kernel_float_sse2;
+        rotation_kernel = rotation_kernel_sse2;
+        rotation_kernel_float = rotation_kernel_float_sse2;
+        harmonic_kernel = harmonic_kernel_sse2;
+        half_band_stage = half_band_sse2;
+    }
+#endif
+}
+
+/**
+ *  Defines a kernel that adds <n> samples of a sine wave with the given <gain>
+ *  to the <type> array <out>, starting at <phase> and advancing by <increment>
+ *  each sample. Portable fallback for the vectorized kernels below.
+ *  Within each SINE_RUN_LENGTH run, phases are extrapolated in double precision
+ *  from an exact one, which adds at most 2.6e-13 to the error of
+ *  sine_polynomial() -- still far below one 16-bit step.
+**/
+#define DEFINE_SCALAR_SINE_KERNEL(name, type)                                  \
+static void name(type *out, size_t n, phase_t phase, phase_t increment,        \
+                 double gain) {                                                \
+    double step = PHASE_TO_UNIT(increment);                                    \
+    for(size_t run = 0; run < n; run += SINE_RUN_LENGTH) {                     \
+        size_t run_end = (n - run < SINE_RUN_LENGTH) ?                         \
+                         n : run + SINE_RUN_LENGTH;                            \
+        double start = PHASE_TO_SIGNED_UNIT(phase + run * increment);          \
+        for(size_t i = run; i < run_end; i++) {                                \
+            out[i] += (type)(gain * sine_polynomial(start + (i - run) * step));\
+        }                                                                      \
+    }                                                                          \
+}
+
+DEFINE_SCALAR_SINE_KERNEL(sine_kernel_scalar, double)
+DEFINE_SCALAR_SINE_KERNEL(sine_kernel_float_scalar, float)
+
+#ifdef X86_SINE_KERNELS
+/**
+ *  Defines a sine kernel that works on <lanes> samples at once, for the given
+ *  <isa>. Same signature and results as the scalar kernel for <type>: each
+ *  lane goes through the range reduction of sine_polynomial(), only with the
+ *  branches replaced by masks. The sine is always computed in double
+ *  precision, and only converted to <type> on its way into <out>.
+**/
+#define DEFINE_SINE_KERNEL(name, type, isa, lanes)                             \
+__attribute__((target(isa)))                                                   \
+static void name(type *out, size_t n, phase_t phase, phase_t increment,        \
+                 double gain) {                                                \
+    typedef double vec __attribute__((vector_size((lanes) * sizeof(double)))); \
+    typedef int64_t ivec                                                       \
+        __attribute__((vector_size((lanes) * sizeof(double))));                \
+    typedef type tvec __attribute__((vector_size((lanes) * sizeof(type))));    \
+    const ivec sign_bit = (ivec){0} + INT64_MIN;                               \
+    double step = PHASE_TO_UNIT(increment);                                    \
+    vec lane;                                                                  \
+    for(int l = 0; l < (lanes); l++) {                                         \
+        lane[l] = l;                                                           \
+    }                                                                          \
+    for(size_t run = 0; run < n; run += SINE_RUN_LENGTH) {                     \
+        size_t run_end = (n - run < SINE_RUN_LENGTH) ?                         \
+                         n : run + SINE_RUN_LENGTH;                            \
+        double start = PHASE_TO_SIGNED_UNIT(phase + run * increment);          \
+        size_t i = run;                                                        \
+        for(; i + (lanes) <= run_end; i += (lanes)) {                          \
+            vec p = start + (lane + (double)(i - run)) * step;                 \
+            vec r = p - ((p + ROUNDING_CONSTANT) - ROUNDING_CONSTANT);         \
+            vec a = (vec)((ivec)r & ~sign_bit);                                \
+            vec b = 0.5 - a;                                                   \
+            ivec fold = (ivec)(a > b);                                         \
+            a = (vec)(((ivec)a & ~fold) | ((ivec)b & fold));                   \
+            vec x = (2 * PI) * a;                                              \
+            vec x2 = x * x;                                                    \
+            vec s = SINE_REDUCED(x, x2);                                       \
+            s = (vec)((ivec)s ^ ((ivec)r & sign_bit));                         \
+            tvec acc;                                                          \
+            memcpy(&acc, out + i, sizeof(acc));                                \
+            acc += __builtin_convertvector(gain * s, tvec);                    \
+            memcpy(out + i, &acc, sizeof(acc));                                \
+        }                                                                      \
+        for(; i < run_end; i++) {                                              \
+            out[i] += (type)(gain * sine_polynomial(start + (i - run) * step));\
+        }                                                                      \
+    }                                                                          \
+}
+
+DEFINE_SINE_KERNEL(sine_kernel_sse2, double, "sse2", 2)
+DEFINE_SINE_KERNEL(sine_kernel_avx2, double, "avx2,fma", 4)
+DEFINE_SINE_KERNEL(sine_kernel_avx512, double, "avx512f", 8)
+DEFINE_SINE_KERNEL(sine_kernel_float_sse2, float, "sse2", 2)
+DEFINE_SINE_KERNEL(sine_kernel_float_avx2, float, "avx2,fma", 4)
+DEFINE_SINE_KERNEL(sine_kernel_float_avx512, float, "avx512f", 8)
+#endif
+
+/**
+ *  Defines a kernel like the scalar sine kernel for <type>, but only the first
+ *  sample of each ROTATION_RUN_LENGTH run comes from sine_polynomial(): the
+ *  rest are produced by rotating the phasor (cos, sin) by one increment at a
+ *  time, which takes four multiplies and two adds. Seeding every run from the
+ *  exact phase keeps the rounding errors of the rotations from piling up:
+ *  samples are never off from sinl() by more than 1.1e-12, still far below
+ *  one 16-bit step.
+**/
+#define DEFINE_SCALAR_ROTATION_KERNEL(name, type)                              \
+static void name(type *out, size_t n, phase_t phase, phase_t increment,        \
+                 double gain) {                                                \
+    double step = PHASE_TO_UNIT(increment);                                    \
+    double step_cos = sine_polynomial(step + 0.25);                            \
+    double step_sin = sine_polynomial(step);                                   \
+    for(size_t run = 0; run < n; run += ROTATION_RUN_LENGTH) {                 \
+        size_t run_end = (n - run < ROTATION_RUN_LENGTH) ?                     \
+                         n : run + ROTATION_RUN_LENGTH;                        \
+        double start = PHASE_TO_SIGNED_UNIT(phase + run * increment);          \
+        double c = sine_polynomial(start + 0.25);                              \
+        double s = sine_polynomial(start);                                     \
+        for(size_t i = run; i < run_end; i++) {                                \
+            out[i] += (type)(gain * s);                                        \
+            double next = s * step_cos + c * step_sin;                         \
+            c = c * step_cos - s * step_sin;                                   \
+            s = next;                                                          \
+        }                                                                      \
+    }                                                                          \
+}
+
+DEFINE_SCALAR_ROTATION_KERNEL(rotation_kernel_scalar, double)
+DEFINE_SCALAR_ROTATION_KERNEL(rotation_kernel_float_scalar, float)
+
+#ifdef X86_SINE_KERNELS
+/**
+ *  Defines a rotation kernel that works on <lanes> samples of <type> at once,
+ *  for the given <isa>. Same signature as the scalar rotation kernel: the
+ *  lanes are seeded with consecutive samples at the start of every run, then
+ *  each is rotated by <lanes> increments at a time. Rotations happen in
+ *  <type>, so single precision gets twice the lanes, along with errors of up
+ *  to 4e-6: about a tenth of a 16-bit step at full volume.
+**/
+#define DEFINE_ROTATION_KERNEL(name, type, isa, lanes)                         \
+__attribute__((target(isa)))                                                   \
+static void name(type *out, size_t n, phase_t phase, phase_t increment,        \
+                 double gain) {                                                \
+    typedef type vec __attribute__((vector_size((lanes) * sizeof(type))));     \
+    enum { width = ROTATION_CHAINS * (lanes) };                                \
+    double step = PHASE_TO_UNIT(increment);                                    \
+    double step_cos = sine_polynomial(step + 0.25);                            \
+    double step_sin = sine_polynomial(step);                                   \
+    double stride = PHASE_TO_UNIT((phase_t)((lanes) * increment));             \
+    vec stride_cos = (vec){0} + (type)sine_polynomial(stride + 0.25);          \
+    vec stride_sin = (vec){0} + (type)sine_polynomial(stride);                 \
+    double leap = PHASE_TO_UNIT((phase_t)(width * increment));                 \
+    vec leap_cos = (vec){0} + (type)sine_polynomial(leap + 0.25);              \
+    vec leap_sin = (vec){0} + (type)sine_polynomial(leap);                     \
+    vec level = (vec){0} + (type)gain;                                         \
+    for(size_t run = 0; run < n; run += ROTATION_RUN_LENGTH) {                 \
+        size_t run_end = (n - run < ROTATION_RUN_LENGTH) ?                     \
+                         n : run + ROTATION_RUN_LENGTH;                        \
+        double start = PHASE_TO_SIGNED_UNIT(phase + run * increment);          \
+        double seed_cos = sine_polynomial(start + 0.25);                       \
+        double seed_sin = sine_polynomial(start);                              \
+        vec c0, s0, c1, s1, c2, s2, c3, s3;                                    \
+        for(int l = 0; l < (lanes); l++) {                                     \
+            c0[l] = seed_cos;                                                  \
+            s0[l] = seed_sin;                                                  \
+            double next = seed_sin * step_cos + seed_cos * step_sin;           \
+            seed_cos = seed_cos * step_cos - seed_sin * step_sin;              \
+            seed_sin = next;                                                   \
+        }                                                                      \
+        c1 = c0 * stride_cos - s0 * stride_sin;                                \
+        s1 = s0 * stride_cos + c0 * stride_sin;                                \
+        c2 = c1 * stride_cos - s1 * stride_sin;                                \
+        s2 = s1 * stride_cos + c1 * stride_sin;                                \
+        c3 = c2 * stride_cos - s2 * stride_sin;                                \
+        s3 = s2 * stride_cos + c2 * stride_sin;                                \
+        size_t i = run;                                                        \
+        for(; i + width <= run_end; i += width) {                              \
+            vec acc[ROTATION_CHAINS];                                          \
+            memcpy(acc, out + i, sizeof(acc));                                 \
+            acc[0] += level * s0;                                              \
+            acc[1] += level * s1;                                              \
+            acc[2] += level * s2;                                              \
+            acc[3] += level * s3;                                              \
+            memcpy(out + i, acc, sizeof(acc));                                 \
+            vec next0 = s0 * leap_cos + c0 * leap_sin;                         \
+            vec next1 = s1 * leap_cos + c1 * leap_sin;                         \
+            vec next2 = s2 * leap_cos + c2 * leap_sin;                         \
+            vec next3 = s3 * leap_cos + c3 * leap_sin;                         \
+            c0 = c0 * leap_cos - s0 * leap_sin;                                \
+            c1 = c1 * leap_cos - s1 * leap_sin;                                \
+            c2 = c2 * leap_cos - s2 * leap_sin;                                \
+            c3 = c3 * leap_cos - s3 * leap_sin;                                \
+            s0 = next0;                                                        \
+            s1 = next1;                                                        \
+            s2 = next2;                                                        \
+            s3 = next3;                                                        \
+        }                                                                      \
+        vec rest[ROTATION_CHAINS] = {s0, s1, s2, s3};                          \
+        for(int k = 0; i < run_end; k++) {                                     \
+            for(int l = 0; l < (lanes) && i < run_end; i++, l++) {             \
+                out[i] += level[l] * rest[k][l];                               \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+}
+
+DEFINE_ROTATION_KERNEL(rotation_kernel_sse2, double, "sse2", 2)
+DEFINE_ROTATION_KERNEL(rotation_kernel_avx2, double, "avx2,fma", 4)
+DEFINE_ROTATION_KERNEL(rotation_kernel_avx512, double, "avx512f", 8)
+DEFINE_ROTATION_KERNEL(rotation_kernel_float_sse2, float, "sse2", 4)
+DEFINE_ROTATION_KERNEL(rotation_kernel_float_avx2, float, "avx2,fma", 8)
+DEFINE_ROTATION_KERNEL(rotation_kernel_float_avx512, float, "avx512f", 16)
+#endif
+
+/**
+ *  Adds to each of the <n> samples of <mix> the sum of <count> harmonics with
+ *  the given <gains>, where the fundamental's sine and twice its cosine at
+ *  that sample are in <sine> and <twice_cosine>. Each harmonic comes from the
+ *  two below it by the Chebyshev recurrence
+ *      sin((k + 1) x) = 2 cos(x) sin(k x) - sin((k - 1) x),
+ *  a multiply and a subtract, so it costs about as much as the add that mixes
+ *  it in. Rounding errors could in theory grow with the square of the harmonic
+ *  number, but against sinl() a stack of 65536 harmonics comes out within
+ *  1e-12 of their total gain: far below one 16-bit step.
+**/
+static void harmonic_kernel_scalar(double *mix, size_t n, const double *sine,
+                                   const double *twice_cosine,
+                                   const double *gains, size_t count) {
+    for(size_t i = 0; i < n; i++) {
+        double previous = 0, current = sine[i];
+        double acc = gains[0] * current;
+        for(size_t k = 1; k < count; k++) {
+            double next = twice_cosine[i] * current - previous;
+            previous = current;
+            current = next;
+            acc += gains[k] * current;
+        }
+        mix[i] += acc;
+    }
+}
+
+#ifdef X86_SINE_KERNELS
+/**
+ *  Defines a version of the scalar harmonic kernel that works on <lanes>
+ *  samples at once, for the given <isa>. Every harmonic is taken a step
+ *  further in HARMONIC_CHAINS vectors of samples before the next, so the
+ *  recurrences don't have to wait on one another.
+**/
+#define DEFINE_HARMONIC_KERNEL(name, isa, lanes)                               \
+__attribute__((target(isa)))                                                   \
+static void name(double *mix, size_t n, const double *sine,                    \
+                 const double *twice_cosine, const double *gains,              \
+                 size_t count) {                                               \
+    typedef double vec __attribute__((vector_size((lanes) * sizeof(*mix))));   \
+    enum { width = HARMONIC_CHAINS * (lanes) };                                \
+    size_t i = 0;                                                              \
+    for(; i + width <= n; i += width) {                                        \
+        vec t0, t1, t2, t3, s0, s1, s2, s3;                                    \
+        memcpy(&t0, twice_cosine + i, sizeof(vec));                            \
+        memcpy(&t1, twice_cosine + i + (lanes), sizeof(vec));                  \
+        memcpy(&t2, twice_cosine + i + 2 * (lanes), sizeof(vec));              \
+        memcpy(&t3, twice_cosine + i + 3 * (lanes), sizeof(vec));              \
+        memcpy(&s0, sine + i, sizeof(vec));                                    \
+        memcpy(&s1, sine + i + (lanes), sizeof(vec));                          \
+        memcpy(&s2, sine + i + 2 * (lanes), sizeof(vec));                      \
+        memcpy(&s3, sine + i + 3 * (lanes), sizeof(vec));                      \
+        vec p0 = {0}, p1 = {0}, p2 = {0}, p3 = {0};                            \
+        vec level = (vec){0} + gains[0];                                       \
+        vec a0 = level * s0, a1 = level * s1;                                  \
+        vec a2 = level * s2, a3 = level * s3;                                  \
+        for(size_t k = 1; k < count; k++) {                                    \
+            vec n0 = t0 * s0 - p0;                                             \
+            vec n1 = t1 * s1 - p1;                                             \
+            vec n2 = t2 * s2 - p2;                                             \
+            vec n3 = t3 * s3 - p3;                                             \
+            p0 = s0;                                                           \
+            p1 = s1;                                                           \
+            p2 = s2;                                                           \
+            p3 = s3;                                                           \
+            s0 = n0;                                                           \
+            s1 = n1;                                                           \
+            s2 = n2;                                                           \
+            s3 = n3;                                                           \
+            level = (vec){0} + gains[k];                                       \
+            a0 += level * s0;                                                  \
+            a1 += level * s1;                                                  \
+            a2 += level * s2;                                                  \
+            a3 += level * s3;                                                  \
+        }                                                                      \
+        vec acc[HARMONIC_CHAINS];                                              \
+        memcpy(acc, mix + i, sizeof(acc));                                     \
+        acc[0] += a0;                                                          \
+        acc[1] += a1;                                                          \
+        acc[2] += a2;                                                          \
+        acc[3] += a3;                                                          \
+        memcpy(mix + i, acc, sizeof(acc));                                     \
+    }                                                                          \
+    for(; i < n; i++) {                                                        \
+        double previous = 0, current = sine[i];                                \
+        double acc = gains[0] * current;                                       \
+        for(size_t k = 1; k < count; k++) {                                    \
+            double next = twice_cosine[i] * current - previous;                \
+            previous = current;                                                \
+            current = next;                                                    \
+            acc += gains[k] * current;                                         \
+        }                                                                      \
+        mix[i] += acc;                                                         \
+    }                                                                          \
+}
+
+DEFINE_HARMONIC_KERNEL(harmonic_kernel_sse2, "sse2", 2)
+DEFINE_HARMONIC_KERNEL(harmonic_kernel_avx2, "avx2,fma", 4)
+DEFINE_HARMONIC_KERNEL(harmonic_kernel_avx512, "avx512f", 8)
+#endif
+
+/**
+ *  Defines a function that adds <n> samples of a harmonic stack to the <type>
+ *  array <out>, in which one 16-bit step is <unit>. The stack's <count>
+ *  partials have the given <gains>, and the first of them starts at <phase>
+ *  and advances by <increment> each sample; the rest follow its phase.
+ *  Only the fundamental's sine and cosine are computed, by
+ *  <polynomial_kernel>, and <harmonic_kernel> takes it from there.
+**/
+#define DEFINE_HARMONIC_STACK(name, type, unit)                                \
+static void name(type *out, size_t n, phase_t phase, phase_t increment,        \
+                 const double *gains, size_t count) {                          \
+    double sine[HARMONIC_RUN_LENGTH];                                          \
+    double twice_cosine[HARMONIC_RUN_LENGTH];                                  \
+    double mix[HARMONIC_RUN_LENGTH];                                           \
+    for(size_t run = 0; run < n; run += HARMONIC_RUN_LENGTH) {                 \
+        size_t size = (n - run < HARMONIC_RUN_LENGTH) ?                        \
+                      n - run : HARMONIC_RUN_LENGTH;                           \
+        phase_t start = phase + run * increment;                               \
+        memset(sine, 0, size * sizeof(*sine));                                 \
+        memset(twice_cosine, 0, size * sizeof(*twice_cosine));                 \
+        memset(mix, 0, size * sizeof(*mix));                                   \
+        polynomial_kernel(sine, size, start, increment, 1);                 \
+        polynomial_kernel(twice_cosine, size, start + ((phase_t)1 << 62),   \
+                             increment, 2);                                    \
+        harmonic_kernel(mix, size, sine, twice_cosine, gains, count);          \
+        for(size_t i = 0; i < size; i++) {                                     \
+            out[run + i] += (type)(mix[i] * (unit));                           \
+        }                                                                      \
+    }                                                                          \
+}
+
+DEFINE_HARMONIC_STACK(harmonic_stack_float, float, 1)
+DEFINE_HARMONIC_STACK(harmonic_stack_double, double, 1)
+DEFINE_HARMONIC_STACK(harmonic_stack_q31, int64_t, Q31_MIX_UNIT)
+
+/**
+ *  Adds <n> samples of a sine wave with the given <gain> to <out>, starting at
+ *  <phase> and advancing by <increment> each sample, computing every one of
+ *  them with sinl(). Slow, but as exact as the long double render path can
+ *  make it.
+**/
+static void sine_kernel_reference(long double *out, size_t n, phase_t phase,
+                                  phase_t increment, double gain) {
+    for(size_t i = 0; i < n; i++, phase += increment) {
+        long double x = (long double)(int64_t)phase * 0x1p-64L;
+        out[i] += gain * sinl(2 * PI_LONG * x);
+    }
+}
+
+/**
+ *  Adds <n> samples of a sine wave with the given <gain> to the fixed-point
+ *  mix <out>, starting at <phase> and advancing by <increment> each sample.
+ *  Each sample is interpolated in Q31 between two points of <q31_sine>, off
+ *  by at most 3e-7 of full scale, then scaled by the gain in Q16.
+**/
+static void sine_kernel_q31(int64_t *out, size_t n, phase_t phase,
+                            phase_t increment, double gain) {
+    int64_t level = llround(gain * Q31_MIX_UNIT);
+    for(size_t i = 0; i < n; i++, phase += increment) {
+        const int32_t *p = q31_sine + (phase >> (64 - Q31_SINE_BITS));
+        int64_t x = (phase >> (32 - Q31_SINE_BITS)) & UINT32_MAX;
+        int64_t sample = p[0] + (((int64_t)(p[1] - p[0]) * x) >> 32);
+        out[i] += (sample * level) >> 31;
+    }
+}
+
+/**
+ *  Fills <q31_sine> with one cycle of a sine wave in Q31, plus the start of
+ *  the next, so that interpolation never has to wrap around.
+**/
+static void build_q31_sine(void) {
+    for(size_t i = 0; i <= Q31_SINE_SIZE; i++) {
+        double phase = (double)i / Q31_SINE_SIZE;
+        q31_sine[i] = (int32_t)lrint(INT32_MAX * sine_polynomial(phase));
+    }
+}
+
+/**
+ *  Returns sin(2 * pi * <phase>), where <phase> is measured in cycles and has
+ *  a magnitude less than 2^51.
+ *  The phase is reduced to a quarter cycle using the symmetries of the sine
+ *  wave, then handed to SINE_REDUCED. Compared against sinl() over phases in
+ *  [-0.5, 0.5), the result is never off by more than 4.5e-16, so 16-bit
+ *  samples come out the same as they would with sinl().
+ *  Inline, so that the vector kernels seeding from it don't have to call out
+ *  of their instruction set to do so.
+**/
+static inline double sine_polynomial(double phase) {
+    double r = phase - ((phase + ROUNDING_CONSTANT) - ROUNDING_CONSTANT);
+    double a = fabs(r);
+    if(a > 0.5 - a) {
+        a = 0.5 - a;
+    }
+    double x = 2 * PI * a;
+    double x2 = x * x;
+    double s = SINE_REDUCED(x, x2);
+    return (r < 0) ? -s : s;
+}
+
+/**
+ *  Returns the levels of the wavetable for the <plain> wave, building them
+ *  first if no sound has needed them yet, or NULL if memory ran out.
+**/
+static double *const *find_wavetable(enum sound_wave plain) {
+    double **levels = wavetables[plain];
+    pthread_mutex_lock(&wavetables_lock);
+    if(!levels[0] && build_wavetable(levels, waves[plain].function)) {
+        levels = NULL;
+    }
+    pthread_mutex_unlock(&wavetables_lock);
+    return levels;
+}
+
+/**
+ *  Fills <levels> with band-limited copies of one cycle of <wave_function>.
+ *  The wave is sampled at WAVETABLE_ANALYSIS_SIZE points and transformed to
+ *  find its harmonics; each level is then the inverse transform of however
+ *  many of those harmonics it keeps.
+ *  Returns 0, or -1 if memory ran out, in which case <levels> is left empty.
+**/
+static int build_wavetable(double **levels,
+                           double (*wave_function)(phase_t)) {
+    size_t analysis_size = WAVETABLE_ANALYSIS_SIZE;
+    double *re = malloc(analysis_size * sizeof(*re));
+    double *im = malloc(analysis_size * sizeof(*im));
+    double *w_re = malloc(analysis_size * sizeof(*w_re));
+    double *w_im = malloc(analysis_size * sizeof(*w_im));
+    double *level_re = malloc(WAVETABLE_SIZE * sizeof(*level_re));
+    double *level_im = malloc(WAVETABLE_SIZE * sizeof(*level_im));
+    int result = (re && im && w_re && w_im && level_re && level_im) ? 0 : -1;
+    for(size_t i = 0; !result && i < analysis_size; i++) {
+        re[i] = wave_function((phase_t)i << (64 - WAVETABLE_BITS - 4));
+        im[i] = 0;
+    }
+    if(!result) {
+        build_twiddles(w_re, w_im, analysis_size, 0);
+        fft_with_twiddles(re, im, analysis_size, w_re, w_im);
+        build_twiddles(w_re, w_im, WAVETABLE_SIZE, 1);
+    }
+
+    for(int level = 0; !result && level < WAVETABLE_LEVELS; level++) {
+        size_t harmonics = WAVETABLE_HARMONICS >> level;
+        // Only the positive harmonics are kept, so the real part of the
+        // inverse transform has to be doubled to account for the negative
+        // ones. The DC offset has no negative twin and is left out entirely.
+        memset(level_re, 0, WAVETABLE_SIZE * sizeof(*level_re));
+        memset(level_im, 0, WAVETABLE_SIZE * sizeof(*level_im));
+        for(size_t h = 1; h <= harmonics; h++) {
+            level_re[h] = 2 * re[h] / analysis_size;
+            level_im[h] = 2 * im[h] / analysis_size;
+        }
+        fft_with_twiddles(level_re, level_im, WAVETABLE_SIZE, w_re, w_im);
+
+        double *table = malloc((WAVETABLE_SIZE + 3) * sizeof(*table));
+        if(!table) {
+            result = -1;
+            break;
+        }
+        table[0] = level_re[WAVETABLE_SIZE - 1];
+        memcpy(table + 1, level_re, WAVETABLE_SIZE * sizeof(*table));
+        table[WAVETABLE_SIZE + 1] = level_re[0];
+        table[WAVETABLE_SIZE + 2] = level_re[1];
+        levels[level] = table;
+    }
+    if(result) {
+        for(int level = 0; level < WAVETABLE_LEVELS; level++) {
+            free(levels[level]);
+            levels[level] = NULL;
+        }
+    }
+    free(level_im);
+    free(level_re);
+    free(w_im);
+    free(w_re);
+    free(im);
+    free(re);
+    return result;
+}
+
+/**
+ *  Returns the level of the wavetable of <sound> with the most harmonics that
+ *  all stay below the Nyquist frequency for an oscillator with the given
+ *  <increment>, or NULL if even the fundamental is too high to be reproduced.
+**/
+static const double *wavetable_level(const struct sound *sound,
+                                     phase_t increment) {
+    double cycles = PHASE_TO_UNIT(increment);
+    if(cycles >= 0.5) {
+        return NULL;
+    }
+    double max_harmonics = 0.5 / cycles;
+    for(int level = 0; level < WAVETABLE_LEVELS; level++) {
+        if((WAVETABLE_HARMONICS >> level) <= max_harmonics) {
+            return sound->wavetable[level];
+        }
+    }
+    return NULL;
+}
+
+/**
+ *  Defines a reader that adds <n> samples read from <table> with the given
+ *  <gain> to the <type> array <out>, in which one 16-bit step is <unit>,
+ *  starting at <phase> and advancing by <increment> each sample, interpolating
+ *  as <mode> says. The top bits of the phase pick the points to interpolate
+ *  between, and the rest say how far between them the sample lies.
+**/
+#define DEFINE_WAVETABLE_READER(name, type, unit)                              \
+static void name(enum sound_wavetable mode, const double *table, type *out,    \
+                 size_t n, phase_t phase, phase_t increment, double gain) {    \
+    gain *= (unit);                                                            \
+    if(mode == SOUND_WAVETABLE_LINEAR) {                                       \
+        for(size_t i = 0; i < n; i++, phase += increment) {                    \
+            const double *p = table + (phase >> (64 - WAVETABLE_BITS));        \
+            double x = PHASE_TO_UNIT(phase << WAVETABLE_BITS);                 \
+            out[i] += (type)(gain * (p[1] + x * (p[2] - p[1])));               \
+        }                                                                      \
+    } else {                                                                   \
+        /* Catmull-Rom spline through the two points on either side. */        \
+        for(size_t i = 0; i < n; i++, phase += increment) {                    \
+            const double *p = table + (phase >> (64 - WAVETABLE_BITS));        \
+            double x = PHASE_TO_UNIT(phase << WAVETABLE_BITS);                 \
+            double a = (3 * (p[1] - p[2]) + p[3] - p[0]) / 2;                  \
+            double b = 2 * p[2] + p[0] - (5 * p[1] + p[3]) / 2;                \
+            double c = (p[2] - p[0]) / 2;                                      \
+            out[i] += (type)(gain * (((a * x + b) * x + c) * x + p[1]));       \
+        }                                                                      \
+    }                                                                          \
+}
+
+DEFINE_WAVETABLE_READER(render_wavetable_float, float, 1)
+DEFINE_WAVETABLE_READER(render_wavetable_double, double, 1)
+DEFINE_WAVETABLE_READER(render_wavetable_long_double, long double, 1)
+DEFINE_WAVETABLE_READER(render_wavetable_q31, int64_t, Q31_MIX_UNIT)
+
+/**
+ *  Fills <w_re> and <w_im> with the n - 1 twiddle factors fft_with_twiddles()
+ *  needs to transform <n> values, forwards or, if <inverse> is set, backwards.
+ *  The factors for each stage follow those of the stage before it.
+**/
+static void build_twiddles(double *w_re, double *w_im, size_t n, int inverse) {
+    for(size_t length = 2; length <= n; length <<= 1) {
+        double angle = (inverse ? 2 : -2) * PI / length;
+        for(size_t k = 0; k < length / 2; k++) {
+            w_re[length / 2 - 1 + k] = cos(angle * k);
+            w_im[length / 2 - 1 + k] = sin(angle * k);
+        }
+    }
+}
+
+/**
+ *  Transforms the <n> complex values split between <re> and <im> in place,
+ *  where <n> is a power of two, with twiddle factors from build_twiddles():
+ *  the forward discrete Fourier transform, or the unnormalized inverse.
+ *  Transforms repeated at the same size need not recompute the factors.
+**/
+static void fft_with_twiddles(double *re, double *im, size_t n,
+                              const double *w_re, const double *w_im) {
+    for(size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for(; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j |= bit;
+        if(i < j) {
+            double t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+    for(size_t length = 2; length <= n; length <<= 1) {
+        const double *stage_re = w_re + length / 2 - 1;
+        const double *stage_im = w_im + length / 2 - 1;
+        for(size_t block = 0; block < n; block += length) {
+            for(size_t k = 0; k < length / 2; k++) {
+                size_t i = block + k, j = i + length / 2;
+                double t_re = re[j] * stage_re[k] - im[j] * stage_im[k];
+                double t_im = re[j] * stage_im[k] + im[j] * stage_re[k];
+                re[j] = re[i] - t_re;
+                im[j] = im[i] - t_im;
+                re[i] += t_re;
+                im[i] += t_im;
+            }
+        }
+    }
+}
+
+/**
+ *  Fills in the tables of the inverse-FFT engine for a 4-term Blackman-Harris
+ *  window centered on its frame.
+ *  The window is a sum of cosines, so its spectrum is a sum of shifted
+ *  transforms of a rectangular window, each of which has a closed form.
+**/
+static void build_inverse_fft_kernel(void) {
+    static const long double coefficients[] = {
+        0.35875L, 0.48829L, 0.14128L, 0.01168L
+    };
+    const int num_coefficients = sizeof(coefficients) / sizeof(*coefficients);
+    for(size_t i = 0; i < IFFT_KERNEL_SIZE; i++) {
+        long double x = (long double)i / IFFT_KERNEL_OVERSAMPLE -
+                        IFFT_KERNEL_BINS / 2.0L;
+        long double re = 0, im = 0;
+        for(int m = 1 - num_coefficients; m < num_coefficients; m++) {
+            // The transform of a rectangular window of IFFT_FRAME_SIZE samples
+            // centered on its frame, y bins away from its center frequency.
+            long double y = x + m;
+            long double amplitude = (y == 0) ? IFFT_FRAME_SIZE :
+                sinl(PI_LONG * y) / sinl(PI_LONG * y / IFFT_FRAME_SIZE);
+            long double weight = (m ? 0.5L : 1) * coefficients[abs(m)];
+            re += weight * amplitude * cosl(PI_LONG * y / IFFT_FRAME_SIZE);
+            im -= weight * amplitude * sinl(PI_LONG * y / IFFT_FRAME_SIZE);
+        }
+        ifft_kernel_re[i] = re / IFFT_FRAME_SIZE;
+        ifft_kernel_im[i] = im / IFFT_FRAME_SIZE;
+    }
+    for(int d = -IFFT_HOP_SIZE; d < IFFT_HOP_SIZE; d++) {
+        long double window = 0;
+        for(int m = 0; m < num_coefficients; m++) {
+            window += coefficients[m] *
+                      cosl(2 * PI_LONG * m * d / IFFT_FRAME_SIZE);
+        }
+        ifft_synthesis[d + IFFT_HOP_SIZE] =
+            (1 - fabsl((long double)d / IFFT_HOP_SIZE)) / window;
+    }
+    build_twiddles(ifft_twiddle_re, ifft_twiddle_im, IFFT_FRAME_SIZE, 1);
+}
+
+/**
+ *  Synthesizes the windowed frame of <partials> centered <center> samples
+ *  after their current phase, leaving it in <re>; <im> is scratch space. Both
+ *  hold IFFT_FRAME_SIZE values.
+ *  Each partial is written into the spectrum as the window's spectrum, shifted
+ *  to its frequency and turned to its phase at the center, but cut off at the
+ *  IFFT_KERNEL_BINS bins nearest that frequency. The real part of the inverse
+ *  transform is then each sine wave under the window, less whatever the
+ *  sidelobes beyond those bins would have added.
+**/
+static void synthesize_frame(const struct partial_table *partials,
+                             uint64_t center, double *re, double *im) {
+    memset(re, 0, IFFT_FRAME_SIZE * sizeof(*re));
+    memset(im, 0, IFFT_FRAME_SIZE * sizeof(*im));
+    for(size_t o = 0; o < partials->size; o++) {
+        phase_t increment = partials->increment[o];
+        double phase = PHASE_TO_UNIT(partials->phase[o] + center * increment);
+        double gain = partials->gain[o];
+        // The sine wave is the real part of gain * e^(i * angle) / i.
+        double c_re = gain * sine_polynomial(phase);
+        double c_im = -gain * sine_polynomial(phase + 0.25);
+        double bins = PHASE_TO_SIGNED_UNIT(increment) * IFFT_FRAME_SIZE;
+        double first = ceil(bins - IFFT_KERNEL_BINS / 2.0);
+        double position = (bins - first + IFFT_KERNEL_BINS / 2.0) *
+                          IFFT_KERNEL_OVERSAMPLE;
+        size_t index = (size_t)position;
+        double fraction = position - index;
+        int64_t k = (int64_t)first;
+        for(int b = 0; b < IFFT_KERNEL_BINS; b++, k++) {
+            size_t i = index - b * IFFT_KERNEL_OVERSAMPLE;
+            double k_re = ifft_kernel_re[i] + fraction *
+                          (ifft_kernel_re[i + 1] - ifft_kernel_re[i]);
+            double k_im = ifft_kernel_im[i] + fraction *
+                          (ifft_kernel_im[i + 1] - ifft_kernel_im[i]);
+            // Centering the window on the frame flips every other bin.
+            if(k & 1) {
+                k_re = -k_re;
+                k_im = -k_im;
+            }
+            size_t bin = (size_t)k & (IFFT_FRAME_SIZE - 1);
+            re[bin] += c_re * k_re - c_im * k_im;
+            im[bin] += c_re * k_im + c_im * k_re;
+        }
+    }
+    fft_with_twiddles(re, im, IFFT_FRAME_SIZE, ifft_twiddle_re,
+                      ifft_twiddle_im);
+}
+
+/**
+ *  Renders <n> samples of <sound>, beginning <start> samples after the current
+ *  phase of each of its partials, by overlap-adding frames from
+ *  synthesize_frame(), mixed in double. The samples go to <out> as they are if
+ *  it isn't NULL, and to <bytes> as 16-bit little-endian PCM otherwise.
+ *  A frame is synthesized every IFFT_HOP_SIZE samples, so the cost per sample
+ *  grows with the number of partials only by a factor of IFFT_KERNEL_BINS
+ *  divided by IFFT_HOP_SIZE, on top of the inverse FFT itself. Every sample
+ *  lies between two frame centers, and is mixed from both frames, weighted by
+ *  its distance to each and divided by the window to take it back out. This
+ *  keeps the division away from the edges of the window, where it is small.
+ *  With the window's sidelobes cut off, each partial comes out within 3e-5 of
+ *  its gain of where the direct sum puts it, so the whole mix comes out within
+ *  3e-5 of full scale: about one 16-bit step at full volume.
+**/
+static void render_inverse_fft(const struct sound *sound, double *out,
+                               uint8_t *bytes, uint64_t start, size_t n) {
+    static const size_t middle = IFFT_FRAME_SIZE / 2;
+    double re[IFFT_FRAME_SIZE], im[IFFT_FRAME_SIZE];
+    // What the frame centered at the start of each hop adds to it.
+    double carry[IFFT_HOP_SIZE];
+    uint64_t hop = start / IFFT_HOP_SIZE;
+    synthesize_frame(&sound->partials, hop * IFFT_HOP_SIZE, re, im);
+    for(size_t d = 0; d < IFFT_HOP_SIZE; d++) {
+        carry[d] = ifft_synthesis[IFFT_HOP_SIZE + d] * re[middle + d];
+    }
+    for(; hop * IFFT_HOP_SIZE < start + n; hop++) {
+        uint64_t first = hop * IFFT_HOP_SIZE;
+        synthesize_frame(&sound->partials, first + IFFT_HOP_SIZE, re, im);
+        for(size_t d = 0; d < IFFT_HOP_SIZE; d++) {
+            uint64_t t = first + d;
+            if(t >= start && t < start + n) {
+                double mixed = carry[d] + ifft_synthesis[d] *
+                                          re[middle - IFFT_HOP_SIZE + d];
+                if(out) {
+                    out[t - start] = mixed;
+                } else {
+                    double clamped = (mixed > INT16_MAX) ? INT16_MAX :
+                                     (mixed < INT16_MIN) ? INT16_MIN : mixed;
+                    uint16_t sample = (uint16_t)(int16_t)clamped;
+                    bytes[2 * (t - start)] = sample & UCHAR_MAX;
+                    bytes[2 * (t - start) + 1] = sample >> CHAR_BIT;
+                }
+            }
+            carry[d] = ifft_synthesis[IFFT_HOP_SIZE + d] * re[middle + d];
+        }
+    }
+}
+
+/**
+ *  Renders samples of <sound> with render_inverse_fft(), as doubles.
+**/
+static void render_double_inverse_fft(const struct sound *sound, double *out,
+                                      uint64_t start, size_t n) {
+    render_inverse_fft(sound, out, NULL, start, n);
+}
+
+/**
+ *  Renders samples of <sound> with render_inverse_fft(), as 16-bit PCM.
+**/
+static void render_pcm16_inverse_fft(const struct sound *sound, uint8_t *bytes,
+                                     uint64_t start, size_t n) {
+    render_inverse_fft(sound, NULL, bytes, start, n);
+}
+
+/**
+ *  Defines a render loop that adds <n> samples of <wave> with the given <gain>
+ *  to the <type> array <out>, in which one 16-bit step is <unit>, starting at
+ *  <phase> and advancing by <increment> each sample. With the wave function
+ *  inlined, each loop compiles down to the arithmetic of its own wave.
+**/
+#define DEFINE_WAVE_LOOP(name, type, unit, wave)                               \
+static void name(type *out, size_t n, phase_t phase, phase_t increment,        \
+                 double gain) {                                                \
+    gain *= (unit);                                                            \
+    for(size_t i = 0; i < n; i++) {                                            \
+        out[i] += (type)(gain * wave(phase + i * increment));                  \
+    }                                                                          \
+}
+
+/* Defines the render loops for <wave> in each precision. */
+#define DEFINE_WAVE_LOOPS(wave)                                                \
+DEFINE_WAVE_LOOP(wave##_loop_float, float, 1, wave##_wave_function)            \
+DEFINE_WAVE_LOOP(wave##_loop_double, double, 1, wave##_wave_function)          \
+DEFINE_WAVE_LOOP(wave##_loop_long_double, long double, 1,                      \
+                 wave##_wave_function)                                         \
+DEFINE_WAVE_LOOP(wave##_loop_q31, int64_t, Q31_MIX_UNIT,                       \
+                 wave##_wave_function)
+
+/**
+ *  Returns a sample of the sine wave at a given phase.
+**/
+static inline double sine_wave_function(phase_t phase) {
+    return sine_polynomial(PHASE_TO_SIGNED_UNIT(phase));
+}
+
+/**
+ *  Returns a sample of the square wave at a given phase.
+**/
+static inline double square_wave_function(phase_t phase) {
+    return (phase >> 63) ? 1 : -1;
+}
+
+/**
+ *  Returns a sample of the triangle wave at a given phase.
+**/
+static inline double triangle_wave_function(phase_t phase) {
+    double x = 4 * PHASE_TO_UNIT(phase);
+    switch(phase >> 62) {
+        case 0:
+            return x;
+        case 3:
+            return x - 4;
+        default:
+            return 2 - x;
+    }
+}
+
+/**
+ *  Returns a sample of the sawtooth wave at a given phase.
+**/
+static inline double sawtooth_wave_function(phase_t phase) {
+    return 2 * PHASE_TO_UNIT(phase) - 1;
+}
+
+/**
+ *  Returns a sample of a point wave at a given phase.
+**/
+static inline double point_wave_function(phase_t phase) {
+    double root = 2 * PHASE_TO_UNIT(phase << 1) - 1;
+    return (1 - sqrt(1 - (root * root))) *
+           (((phase >> 62) == 1 || (phase >> 62) == 2) ? -1 : 1);
+}
+
+/**
+ *  Returns a sample of a circle wave at a given phase.
+**/
+static inline double circle_wave_function(phase_t phase) {
+    double root = 2 * PHASE_TO_UNIT(phase << 1) - 1;
+    return sqrt(1 - (root * root)) *
+           (((phase >> 62) == 1 || (phase >> 62) == 2) ? -1 : 1);
+}
+
+/**
+ *  Returns what has to be added to a unit step up at phase 0 to band-limit it,
+ *  at a given <phase> of a wave advancing by <step> cycles each sample: the
+ *  two-sample polynomial residual of PolyBLEP, which smooths the step into the
+ *  integral of a triangle one sample wide on each side.
+**/
+static inline double step_residual(phase_t phase, double step) {
+    double t = PHASE_TO_SIGNED_UNIT(phase);
+    if(t >= 0 && t < step) {
+        double x = 1 - t / step;
+        return -x * x / 2;
+    }
+    if(t < 0 && t > -step) {
+        double x = 1 + t / step;
+        return x * x / 2;
+    }
+    return 0;
+}
+
+/**
+ *  Returns what has to be added to a unit ramp starting at phase 0 to
+ *  band-limit its corner, at a given <phase> of a wave advancing by <step>
+ *  cycles each sample: the PolyBLAMP residual, the integral of the one from
+ *  step_residual().
+**/
+static inline double ramp_residual(phase_t phase, double step) {
+    double t = PHASE_TO_SIGNED_UNIT(phase);
+    double x = 1 - fabs(t) / step;
+    return (x > 0) ? step * x * x * x / 6 : 0;
+}
+
+/**
+ *  Returns a sample of the square wave at a given phase, with its steps
+ *  band-limited by PolyBLEP for a wave advancing by <step> cycles each sample.
+**/
+static inline double polyblep_square_wave_function(phase_t phase,
+                                                   double step) {
+    return square_wave_function(phase) - 2 * step_residual(phase, step) +
+           2 * step_residual(phase - ((phase_t)1 << 63), step);
+}
+
+/**
+ *  Returns a sample of the sawtooth wave at a given phase, with its drop
+ *  band-limited by PolyBLEP for a wave advancing by <step> cycles each sample.
+**/
+static inline double polyblep_sawtooth_wave_function(phase_t phase,
+                                                     double step) {
+    return sawtooth_wave_function(phase) - 2 * step_residual(phase, step);
+}
+
+/**
+ *  Returns a sample of the triangle wave at a given phase, with its corners
+ *  band-limited by PolyBLAMP for a wave advancing by <step> cycles each
+ *  sample. Its slope turns from 4 to -4 a quarter of the way through each
+ *  cycle, and back three quarters of the way through.
+**/
+static inline double polyblep_triangle_wave_function(phase_t phase,
+                                                     double step) {
+    return triangle_wave_function(phase) -
+           8 * ramp_residual(phase - ((phase_t)1 << 62), step) +
+           8 * ramp_residual(phase - ((phase_t)3 << 62), step);
+}
+
+/**
+ *  Defines a render loop like DEFINE_WAVE_LOOP() for a band-limited <wave>,
+ *  which also needs to know how far the phase advances each sample. Phases
+ *  that advance by more than half a cycle are taken to be going backwards by
+ *  less, since that's what the samples alias to.
+**/
+#define DEFINE_BAND_LIMITED_LOOP(name, type, unit, wave)                       \
+static void name(type *out, size_t n, phase_t phase, phase_t increment,        \
+                 double gain) {                                                \
+    double step = fabs(PHASE_TO_SIGNED_UNIT(increment));                       \
+    gain *= (unit);                                                            \
+    for(size_t i = 0; i < n; i++) {                                            \
+        out[i] += (type)(gain * wave(phase + i * increment, step));            \
+    }                                                                          \
+}
+
+/* Defines the render loops for the band-limited <wave> in each precision. */
+#define DEFINE_BAND_LIMITED_LOOPS(wave)                                        \
+DEFINE_BAND_LIMITED_LOOP(wave##_loop_float, float, 1, wave##_wave_function)    \
+DEFINE_BAND_LIMITED_LOOP(wave##_loop_double, double, 1, wave##_wave_function)  \
+DEFINE_BAND_LIMITED_LOOP(wave##_loop_long_double, long double, 1,              \
+                         wave##_wave_function)                                 \
+DEFINE_BAND_LIMITED_LOOP(wave##_loop_q31, int64_t, Q31_MIX_UNIT,               \
+                         wave##_wave_function)
+
+DEFINE_WAVE_LOOPS(sine)
+DEFINE_WAVE_LOOPS(square)
+DEFINE_WAVE_LOOPS(triangle)
+DEFINE_WAVE_LOOPS(sawtooth)
+DEFINE_WAVE_LOOPS(point)
+DEFINE_WAVE_LOOPS(circle)
+DEFINE_BAND_LIMITED_LOOPS(polyblep_square)
+DEFINE_BAND_LIMITED_LOOPS(polyblep_sawtooth)
+DEFINE_BAND_LIMITED_LOOPS(polyblep_triangle)
+
+
@@ -11,18 +11,63 @@
  *
 **/
 
-#include <math.h>
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <stdarg.h>
 #include <getopt.h>
 #include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "sound.h"
+
+
+/* The number of samples write_samples() renders and writes at a time. */
+#define RENDER_BLOCK_SIZE (4096)
+
+/* The number of samples each thread renders at a time with --threads. */
+#define RENDER_CHUNK_SIZE (16 * RENDER_BLOCK_SIZE)
+
+/* The room given to the message describing a bad option or request. */
+#define ERROR_SIZE (256)
+
+/* The longest request line --serve reads, newline included. */
+#define MAX_REQUEST_SIZE (4096)
+
+/* The number of connections --serve queues up for a free thread. */
+#define SERVE_BACKLOG (64)
 
+/* The length of a cache key, a 128-bit hash in hex, with its terminator. */
+#define CACHE_KEY_SIZE (33)
 
-#define PI (3.14159265358979323846264338327950288419716939937)
+/**
+ *  Goes into every cache key. It must change whenever the same options start
+ *  rendering different samples, so that renders cached before aren't used.
+**/
+#define CACHE_VERSION (2)
+
+/* The number of bytes copied at a time into and out of the cache. */
+#define CACHE_COPY_SIZE (64 * 1024)
+
+/* The shapes of header that write_header() can produce. */
+enum header_layout {
+    HEADER_RIFF,        /* The classic 44-byte header. */
+    HEADER_RESERVED,    /* RIFF, with a JUNK chunk saving room for ds64. */
+    HEADER_RF64         /* RF64, with the sizes in the ds64 chunk. */
+};
 
 #define CHUNK_ID        "RIFF"
 #define FORMAT          "WAVE"
@@ -31,7 +76,7 @@
 #define AUDIO_FORMAT    (1)
 #define NUM_CHANNELS    (1)
 #define BITS_PER_SAMPLE (16)
-#define BYTE_RATE       (sample_rate * NUM_CHANNELS * BITS_PER_SAMPLE / 8)
+#define BYTE_RATE(rate) ((rate) * NUM_CHANNELS * BITS_PER_SAMPLE / 8)
 #define BLOCK_ALIGN     (NUM_CHANNELS * BITS_PER_SAMPLE / 8)
 #define SUBCHUNK2_ID    "data"
 
@@ -64,35 +109,257 @@
 #define SUBCHUNK2_SIZE_OFFSET   (40)
 #define DATA_OFFSET             (44)
 
+/**
+ *  RF64 (EBU Tech 3306) gets past the 4 GiB limit of RIFF by keeping 64-bit
+ *  sizes in a "ds64" chunk right after the format ID, and marking the 32-bit
+ *  fields unknown. A "JUNK" chunk of the same size holds the place of a ds64
+ *  chunk in files that may need promoting later.
+**/
+#define RF64_CHUNK_ID           "RF64"
+#define DS64_ID                 "ds64"
+#define JUNK_ID                 "JUNK"
+#define DS64_SIZE               (28)
+#define DS64_CHUNK_SIZE         (DS64_ID_SIZE + DS64_SIZE_SIZE + DS64_SIZE)
+
+#define DS64_ID_SIZE            (4)
+#define DS64_SIZE_SIZE          (4)
+#define DS64_RIFF_SIZE_SIZE     (8)
+#define DS64_DATA_SIZE_SIZE     (8)
+#define DS64_SAMPLE_COUNT_SIZE  (8)
+#define DS64_TABLE_LENGTH_SIZE  (4)
+
+#define DS64_ID_OFFSET          (12)
+#define DS64_SIZE_OFFSET        (16)
+#define DS64_RIFF_SIZE_OFFSET   (20)
+#define DS64_DATA_SIZE_OFFSET   (28)
+#define DS64_SAMPLE_COUNT_OFFSET (36)
+
+/* The size of the largest header this program writes or reads. */
+#define MAX_HEADER_SIZE         (DATA_OFFSET + DS64_CHUNK_SIZE)
+
+/* Stands in for the 32-bit size fields when they can't hold the real size. */
+#define UNKNOWN_SIZE            (UINT32_MAX)
+
+/* Stands in for the size of a stream whose length isn't known. */
+#define UNKNOWN_LENGTH          (UINT64_MAX)
+
+/**
+ *  Everything needed to render samples of a sound for write_samples(), along
+ *  with the bookkeeping shared between threads when rendering with more than
+ *  one.
+**/
+struct render_job {
+    const struct sound *sound;
+    uint64_t num_samples;
+    /* Where in memory to put the samples, or NULL to write them to <out>. */
+    uint8_t *destination;
+
+    /* The output descriptor to pwrite() chunks to, or -1 to write in order. */
+    int fd;
+    off_t data_offset;
+    uint64_t num_chunks;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /* The next chunk to be claimed by a thread, and to be written in order. */
+    uint64_t next_chunk;
+    uint64_t next_write;
+    /* Rendered chunks waiting to be written, and which chunk is in each. */
+    size_t num_slots;
+    uint8_t *slots;
+    uint64_t *slot_chunks;
+};
+
+/**
+ *  A sound asked of the server: the options that describe it, which start out
+ *  as whatever the server itself was given, and whether to leave out the
+ *  header.
+**/
+struct request {
+    struct sound_params params;
+    uint32_t duration;
+    uint8_t raw;
+};
+
+/**
+ *  The bookkeeping shared between the threads of the server: the connections
+ *  accepted but not yet taken up by a thread, and the one each thread is
+ *  serving, so that they can all be cut short when the server stops.
+**/
+struct server {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending[SERVE_BACKLOG];
+    size_t first_pending;
+    size_t num_pending;
+    /* One per thread, -1 while the thread waits for a connection. */
+    int *serving;
+    uint8_t closing;
+};
+
+/**
+ *  One note of a --score: the samples it starts and stops at, the sound it
+ *  makes, and the line it came from, which breaks ties between notes that
+ *  start together.
+**/
+struct note {
+    uint64_t start;
+    uint64_t end;
+    struct sound_params params;
+    long double *frequencies;
+    unsigned long line;
+};
+
+/* Which sounding note a --score cuts off when it needs a voice for another. */
+enum steal_policy {
+    STEAL_OLDEST,
+    STEAL_QUIETEST
+};
+
+/* A voice of a struct voice_pool, and the note it plays while it sounds. */
+struct voice {
+    struct sound *sound;
+    uint64_t start;
+    uint64_t end;
+    long double volume;
+};
+
+/**
+ *  The voices a --score is played with, each with room for the largest note in
+ *  it, all allocated before the first sample is rendered so that playing notes
+ *  never has to. Free voices are stacked on <free>, and the <num_active> that
+ *  are sounding are in <active>, sorted by when they end.
+**/
+struct voice_pool {
+    struct voice *voices;
+    struct voice **free;
+    size_t num_free;
+    struct voice **active;
+    size_t num_active;
+    size_t capacity;
+};
+
+/* A render in the cache directory, as cache_evict() sees it. */
+struct cache_entry {
+    char key[CACHE_KEY_SIZE];
+    struct timespec used;
+    off_t size;
+};
+
+/* One line of a --batch manifest: a sound, and the file it goes to. */
+struct batch_job {
+    char *path;
+    struct request request;
+    long double *frequencies;
+};
+
+/**
+ *  The jobs of a --batch manifest that one thread has yet to get to, from
+ *  <next> up to <end>. The thread works forwards from <next>; threads that
+ *  run out of their own take the back half of someone else's.
+**/
+struct batch_queue {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t end;
+};
+
+/* Everything a thread of a --batch needs to know. */
+struct batch_worker {
+    const struct batch_job *jobs;
+    struct batch_queue *queues;
+    uint16_t num_queues;
+    uint16_t index;
+    /* How many of the jobs this thread took on failed. */
+    size_t failures;
+};
+
 
 void usage(int);
+void usage_error(const char *);
 int process_flags(int, char **);
-void process_wave_opt(const char *);
-long parse_int_opt(const char *, const char *, long, long);
-long double parse_float_opt(const char *, const char *, long double,
-                            long double);
-uint32_t get_num_samples(uint32_t);
-void write_samples(long double *, uint8_t, long double, uint32_t,
-                   long double(long double, uint32_t));
-long double sine_wave_function(long double, uint32_t);
-long double square_wave_function(long double, uint32_t);
-long double triangle_wave_function(long double, uint32_t);
-long double sawtooth_wave_function(long double, uint32_t);
-long double point_wave_function(long double, uint32_t);
-long double circle_wave_function(long double, uint32_t);
-void create_sound_file(uint32_t);
-void append_sound_file(uint32_t);
-void verify_int_header(const char *, size_t, size_t, uint8_t);
-void verify_string_header(const char *, const char *, size_t, size_t);
-void write_int_data(size_t, uint8_t);
-size_t read_int_data(FILE *, uint8_t);
-void checked_fputc(uint8_t, FILE *);
-void checked_fprintf(FILE *, const char *, ...);
-uint8_t checked_fgetc(FILE *);
+int process_sound_opt(int, const char *, struct sound_params *, uint32_t *,
+                      char *);
+int process_wave_opt(const char *, struct sound_params *, char *);
+int process_wavetable_opt(const char *, struct sound_params *, char *);
+int process_sine_opt(const char *, struct sound_params *, char *);
+int process_precision_opt(const char *, struct sound_params *, char *);
+int process_additive_opt(const char *, struct sound_params *, char *);
+int process_oversample_opt(const char *, struct sound_params *, char *);
+int process_envelope_opt(const char *, struct sound_params *, char *);
+int process_curve_opt(const char *, struct sound_params *, char *);
+int parse_int_opt(const char *, const char *, long, long, long *, char *);
+int parse_float_opt(const char *, const char *, long double, long double,
+                    long double *, char *);
+int check_params(const struct sound_params *, char *);
+uint64_t get_num_samples(uint32_t, uint32_t);
+void write_samples(struct sound *, uint64_t, uint16_t, uint8_t *);
+void stream_samples(struct sound *, uint64_t);
+void request_stop(int);
+void install_stop_handler(void);
+void write_samples_threaded(struct render_job *, uint16_t);
+void *render_worker(void *);
+size_t chunk_size(const struct render_job *, uint64_t);
+uint64_t write_samples_tiled(const struct render_job *, uint64_t);
+void render_tile(const struct render_job *, uint8_t *, uint64_t, uint64_t);
+int emit_samples(const struct sound *, uint64_t, uint8_t *,
+                 int (*)(void *, const void *, size_t), void *);
+void serve(const char *);
+void *serve_worker(void *);
+void serve_connection(int, FILE *);
+int serve_request(int, char *);
+int parse_request(char **, int, struct request *, long double *, char *);
+const struct option *find_option(const char *);
+int send_all(int, const void *, size_t);
+int emit_to_socket(void *, const void *, size_t);
+int run_batch(const char *);
+size_t read_batch(const char *, struct batch_job **);
+int parse_batch_line(char *, struct batch_job *, char *);
+void *batch_worker(void *);
+int take_batch_job(struct batch_worker *, size_t *);
+int render_batch_job(const struct batch_job *, uint8_t *, char *);
+int emit_to_file(void *, const void *, size_t);
+void cache_key(const struct sound_params *, uint64_t, uint8_t, char *);
+void hash_bytes(uint64_t *, const void *, size_t);
+int cache_fetch(const char *, int);
+void cache_store(const char *, const char *);
+void cache_evict(void);
+int compare_cache_entries(const void *, const void *);
+char *cache_path(const char *);
+int copy_file_data(int, int);
+void write_score(const char *);
+size_t read_score(const char *, struct note **);
+int parse_score_line(char *, struct note *, char *);
+int compare_notes(const void *, const void *);
+void render_score(const struct note *, size_t, uint64_t, uint8_t *);
+void init_voice_pool(struct voice_pool *, size_t, size_t);
+void free_voice_pool(struct voice_pool *);
+void start_voice(struct voice_pool *, const struct note *);
+struct voice *steal_voice(struct voice_pool *);
+void retire_voices(struct voice_pool *, uint64_t);
+void quantize_block(const double *, size_t, uint8_t *);
+void create_sound_file(uint64_t);
+void create_stream_file(void);
+void build_header(uint8_t *, uint64_t, enum header_layout);
+size_t fill_header(uint8_t *, uint32_t, uint64_t, enum header_layout);
+enum header_layout current_layout(uint64_t);
+uint8_t *append_sound_file(uint64_t);
+void map_out(uint64_t);
+void insert_ds64_chunk(uint64_t);
+void finish_stream_file(void);
+void verify_int_header(const uint8_t *, const char *, size_t, size_t, uint8_t);
+void verify_string_header(const uint8_t *, const char *, const char *, size_t,
+                          size_t);
+void store_int_data(uint8_t *, size_t, uint8_t);
+size_t load_int_data(const uint8_t *, uint8_t);
+void checked_fwrite(const void *, size_t, FILE *);
+void checked_pwrite(int, const void *, size_t, off_t);
+void checked_fflush(FILE *);
+long checked_ftell(FILE *);
+void *checked_malloc(size_t);
+void *checked_realloc(void *, size_t);
 void checked_fseek(FILE *, long, int);
 void close_out(void);
 
-
 /* Used for calls to perror(). */
 static const char *program_name;
 static const char *const default_program_name = "sound";
@@ -102,27 +369,32 @@ static uint32_t duration;
 static const uint32_t default_duration = 1000;
 
 /**
- *  The volume of the sound.
- *  Specifically, a constant that each sample is multiplied by.
+ *  Everything about the sound itself: the defaults of libsound, then whatever
+ *  the command line changes. main() fills in the frequencies.
 **/
-static long double volume;
-static const long double default_volume = 33.333333;
-
-/* The number of overtones to create above each frequency. */
-static int8_t num_overtones;
-static const int8_t default_num_overtones = 0;
-
-/* The type of wave to produce */
-static long double (*wave_function)(long double, uint32_t);
-static long double (*const default_wave_function)(long double, uint32_t) =
-    sine_wave_function;
+static struct sound_params params;
 
 /* The name of the default wave. Used in usage message. */
 static const char *const default_wave_function_name = "sine";
 
-/* The number of samples per second to capture */
-static uint32_t sample_rate;
-static const uint32_t default_sample_rate = 44100;
+/* The name of the default wavetable mode. Used in usage message. */
+static const char *const default_wavetable_mode_name = "off";
+
+/* The name of the default sine method. Used in usage message. */
+static const char *const default_sine_method_name = "rotation";
+
+/* The name of the default precision. Used in usage message. */
+static const char *const default_precision_name = "float";
+
+/* The name of the default additive engine. Used in usage message. */
+static const char *const default_additive_engine_name = "auto";
+
+/* The name of the default envelope curve. Used in usage message. */
+static const char *const default_curve_name = "linear";
+
+/* The number of threads to render samples with. */
+static uint16_t num_threads;
+static const uint16_t default_num_threads = 1;
 
 /* The file to write the produced sound to. */
 static FILE *out;
@@ -138,30 +410,181 @@ static const char *const default_out_name = "stdout";
 static uint8_t append_mode;
 static const uint8_t default_append_mode = 0;
 
+/**
+ *  Should samples be rendered until interrupted, rather than for a set
+ *  duration? A duration given alongside still caps the length of the stream.
+**/
+static uint8_t stream_mode;
+static const uint8_t default_stream_mode = 0;
+
+/* Was a duration given on the command line? */
+static uint8_t duration_given;
+
+/* Should the samples go out bare, without a header? */
+static uint8_t raw_mode;
+static const uint8_t default_raw_mode = 0;
+
+/* The path of the socket to serve requests on, or NULL to render just once. */
+static const char *serve_path;
+
+/* The path of the manifest of sounds to render, or NULL to render just one. */
+static const char *batch_path;
+
+/* The path of the score to render, or NULL to render a single chord. */
+static const char *score_path;
+
+/* The number of notes of a score that can sound at once. */
+static uint16_t num_voices;
+static const uint16_t default_num_voices = 64;
+
+/* Which note of a score makes way when more than <num_voices> sound at once. */
+static enum steal_policy steal_policy;
+static const enum steal_policy default_steal_policy = STEAL_OLDEST;
+
+/* The name of the default steal policy. Used in usage message. */
+static const char *const default_steal_policy_name = "oldest";
+
+/* The directory to keep renders in for reuse, or NULL to render every time. */
+static const char *cache_dir;
+
+/* The size (in megabytes) the cache is trimmed to, oldest renders first. */
+static uint32_t cache_megabytes;
+static const uint32_t default_cache_megabytes = 256;
+
+/**
+ *  Where the data chunk of the output file begins: DATA_OFFSET, or further in
+ *  if the header has room for a ds64 chunk.
+**/
+static long data_offset;
+
+/* Is the output file in RF64 rather than RIFF format? */
+static uint8_t is_rf64;
+
+/* The output file mapped into memory for appending, if it has been. */
+static uint8_t *out_map;
+static size_t out_map_size;
+
+/* Set by request_stop() to end a stream after the block in progress. */
+static volatile sig_atomic_t stop_requested;
+
+/* The options, long and short, that the command line and requests may use. */
+static const struct option options[] = {
+    {"file",            required_argument,  NULL,   'f'},
+    {"append",          required_argument,  NULL,   'a'},
+    {"duration",        required_argument,  NULL,   'd'},
+    {"volume",          required_argument,  NULL,   'v'},
+    {"sample-rate",     required_argument,  NULL,   's'},
+    {"wave-function",   required_argument,  NULL,   'w'},
+    {"overtones",       required_argument,  NULL,   'o'},
+    {"threads",         required_argument,  NULL,   't'},
+    {"wavetable",       required_argument,  NULL,   'W'},
+    {"sine-kernel",     required_argument,  NULL,   'k'},
+    {"precision",       required_argument,  NULL,   'p'},
+    {"additive",        required_argument,  NULL,   'A'},
+    {"oversample",      required_argument,  NULL,   'O'},
+    {"envelope",        required_argument,  NULL,   'E'},
+    {"curve",           required_argument,  NULL,   'c'},
+    {"raw",             no_argument,        NULL,   'r'},
+    {"stream",          no_argument,        NULL,   'S'},
+    {"serve",           required_argument,  NULL,   'L'},
+    {"batch",           required_argument,  NULL,   'B'},
+    {"score",           required_argument,  NULL,   'N'},
+    {"voices",          required_argument,  NULL,   'V'},
+    {"steal",           required_argument,  NULL,   'X'},
+    {"cache",           required_argument,  NULL,   'C'},
+    {"cache-size",      required_argument,  NULL,   'M'},
+    {"help",            no_argument,        NULL,   'h'},
+    {0, 0, 0, 0}
+};
+static const char *const short_options =
+    "f:a:d:v:s:w:o:t:W:k:p:A:O:E:c:rSL:B:N:V:X:C:M:h";
+
+/* The options a request to the server may use; the rest need a shell. */
+static const char *const request_options = "dvswoWkpAOEcr";
+
 
 int main(int argc, char **argv) {
     int argindex = process_flags(argc, argv);
+    if(serve_path) {
+        serve(serve_path);
+        return 0;
+    } else if(batch_path) {
+        return run_batch(batch_path);
+    } else if(score_path) {
+        write_score(score_path);
+        return 0;
+    }
 
-    uint32_t num_samples = get_num_samples(duration);
+    char error[ERROR_SIZE];
+    uint64_t num_samples = get_num_samples(duration, params.sample_rate);
     int num_pitches = argc - argindex;
-    int num_frequencies = (num_overtones + 1) * num_pitches;
-    long double frequencies[num_frequencies];
+    long double *frequencies = checked_malloc(num_pitches *
+                                              sizeof(*frequencies));
     for(int p = 0; p < num_pitches; p++) {
-        long double fundamental = parse_float_opt(argv[p + argindex],
-                                                  "Frequency", 1, 30000);
-        for(int o = 0; o <= num_overtones; o++) {
-            frequencies[(p * (num_overtones + 1)) + o] = (o + 1) * fundamental;
+        if(parse_float_opt(argv[p + argindex], "Frequency", 1, 30000,
+                           &frequencies[p], error)) {
+            usage_error(error);
+        }
+    }
+    params.num_frequencies = num_pitches;
+    params.frequencies = frequencies;
+    params.length = (stream_mode && !duration_given) ? 0 : num_samples;
+    if(check_params(&params, error)) {
+        fprintf(stderr, "%s: %s\n", program_name, error);
+        exit(1);
+    }
+
+    // Only whole files are cached; appends and streams always render.
+    char key[CACHE_KEY_SIZE];
+    uint8_t cached = cache_dir && !append_mode && !stream_mode;
+    if(cached) {
+        mkdir(cache_dir, 0777);
+        cache_key(&params, num_samples, raw_mode, key);
+        int fetched = cache_fetch(key, fileno(out));
+        if(fetched < 0) {
+            fprintf(stderr, "%s: %s: Write failed.\n", program_name,
+                    out_name);
+            exit(1);
+        } else if(!fetched) {
+            free(frequencies);
+            cache_evict();
+            return 0;
         }
     }
+    struct sound *sound = sound_create(&params);
+    if(!sound) {
+        fprintf(stderr, "%s: %s.\n", program_name, strerror(errno));
+        exit(1);
+    }
+    free(frequencies);
 
+    uint8_t *destination = NULL;
     if(append_mode) {
-        append_sound_file(num_samples);
-    } else {
+        destination = append_sound_file(num_samples);
+    } else if(stream_mode && !raw_mode) {
+        create_stream_file();
+    } else if(!raw_mode) {
         create_sound_file(num_samples);
     }
 
-    write_samples(frequencies, num_frequencies, volume, num_samples,
-                  wave_function);
+    if(stream_mode) {
+        install_stop_handler();
+        stream_samples(sound, duration_given ? num_samples : 0);
+        if(!raw_mode) {
+            finish_stream_file();
+        }
+    } else {
+        write_samples(sound, num_samples, num_threads, destination);
+    }
+    sound_destroy(sound);
+    if(cached) {
+        // Standard output can't be read back, so it doesn't get cached.
+        checked_fflush(out);
+        if(out != stdout) {
+            cache_store(key, out_name);
+        }
+        cache_evict();
+    }
 
     return 0;
 }
@@ -171,6 +594,8 @@ int main(int argc, char **argv) {
  *  value.
 **/
 void usage(int exit_value) {
+    struct sound_params defaults;
+    sound_default_params(&defaults);
     fprintf(stderr, "usage: %s "
                     "[-f|--file <file=%s>] "
                     "[-a|--append <file>] "
@@ -178,14 +603,49 @@ void usage(int exit_value) {
                     "[-v|--volume <volume=%Lf>] "
                     "[-s|--sample-rate <sample-rate=%u] "
                     "[-w|--wave-function <wave=%s>] "
-                    "[-o|--overtones <overtones=%hhd>] "
-                    "frequency [frequency ...]\n",
+                    "[-o|--overtones <overtones=%hu>] "
+                    "[-t|--threads <threads=%hu>] "
+                    "[-W|--wavetable <wavetable=%s>] "
+                    "[-k|--sine-kernel <kernel=%s>] "
+                    "[-p|--precision <precision=%s>] "
+                    "[-A|--additive <engine=%s>] "
+                    "[-O|--oversample <factor=%hhu>] "
+                    "[-E|--envelope <attack,decay,sustain,release="
+                    "%u,%u,%Lg,%u>] "
+                    "[-c|--curve <curve=%s>] "
+                    "[-r|--raw] "
+                    "[-S|--stream] "
+                    "[-V|--voices <voices=%hu>] "
+                    "[-X|--steal <voice=%s>] "
+                    "[-C|--cache <directory>] "
+                    "[-M|--cache-size <megabytes=%u>] "
+                    "frequency [frequency ...]\n"
+                    "       %s [options] -L|--serve <socket>\n"
+                    "       %s [options] -B|--batch <manifest>\n"
+                    "       %s [options] -N|--score <score>\n",
                     program_name, default_out_name, default_duration,
-                    default_volume, default_sample_rate,
-                    default_wave_function_name, default_num_overtones);
+                    defaults.volume, defaults.sample_rate,
+                    default_wave_function_name, defaults.overtones,
+                    default_num_threads, default_wavetable_mode_name,
+                    default_sine_method_name, default_precision_name,
+                    default_additive_engine_name, defaults.oversample,
+                    defaults.attack, defaults.decay, defaults.sustain,
+                    defaults.release, default_curve_name,
+                    default_num_voices, default_steal_policy_name,
+                    default_cache_megabytes, program_name, program_name,
+                    program_name);
     exit(exit_value);
 }
 
+/**
+ *  Prints <error>, the complaint about an option, then the usage message, and
+ *  exits with failure.
+**/
+void usage_error(const char *error) {
+    fprintf(stderr, "%s: %s\n", program_name, error);
+    usage(1);
+}
+
 /**
  *  Uses getopt_long() to process command line flags.
  *  Should only be called with <argc> and <argv> from main().
@@ -199,29 +659,47 @@ int process_flags(int argc, char **argv) {
     out = stdout;
     out_name = default_out_name;
     duration = default_duration;
-    volume = default_volume;
-    sample_rate = default_sample_rate;
-    wave_function = default_wave_function;
-    num_overtones = default_num_overtones;
-    struct option options[] = {
-        {"file",            required_argument,  NULL,   'f'},
-        {"append",          required_argument,  NULL,   'a'},
-        {"duration",        required_argument,  NULL,   'd'},
-        {"volume",          required_argument,  NULL,   'v'},
-        {"sample-rate",     required_argument,  NULL,   's'},
-        {"wave-function",   required_argument,  NULL,   'w'},
-        {"overtones",       required_argument,  NULL,   'o'},
-        {"help",            no_argument,        NULL,   'h'},
-        {0, 0, 0, 0}
-    };
+    sound_default_params(&params);
+    num_threads = default_num_threads;
+    stream_mode = default_stream_mode;
+    raw_mode = default_raw_mode;
+    duration_given = 0;
+    serve_path = NULL;
+    batch_path = NULL;
+    score_path = NULL;
+    num_voices = default_num_voices;
+    steal_policy = default_steal_policy;
+    cache_dir = NULL;
+    cache_megabytes = default_cache_megabytes;
+    char error[ERROR_SIZE];
+    long value;
     for(;;) {
-        int c = getopt_long(argc, argv, "f:a:d:v:s:w:o:h", options, &optind);
+        int c = getopt_long(argc, argv, short_options, options, &optind);
         switch(c) {
             case -1:
-                if(optind >= argc) {
+                if(!!serve_path + !!batch_path + !!score_path > 1) {
+                    fprintf(stderr, "%s: Only one of --serve, --batch and "
+                            "--score at a time.\n", program_name);
+                    usage(1);
+                } else if(score_path && (optind < argc || stream_mode)) {
+                    fprintf(stderr, "%s: A score has its own frequencies and "
+                            "length.\n", program_name);
+                    usage(1);
+                } else if((serve_path || batch_path) &&
+                          (optind < argc || out != stdout || stream_mode)) {
+                    fprintf(stderr, "%s: Frequencies and output come from the "
+                            "%s.\n", program_name,
+                            serve_path ? "requests" : "manifest");
+                    usage(1);
+                } else if(!serve_path && !batch_path && !score_path &&
+                          optind >= argc) {
                     fprintf(stderr, "%s: At least one frequency required.\n",
                             program_name);
                     usage(1);
+                } else if(append_mode && raw_mode) {
+                    fprintf(stderr, "%s: Cannot append raw samples.\n",
+                            program_name);
+                    exit(1);
                 }
                 return optind;
             case 'a':
@@ -256,400 +734,2308 @@ int process_flags(int argc, char **argv) {
                 atexit(close_out);
                 out_name = optarg;
                 break;
-            case 'd':
-                duration = parse_int_opt(optarg, "Duration", 1, UINT32_MAX);
+            case 't':
+                if(parse_int_opt(optarg, "Threads", 1, 1024, &value, error)) {
+                    usage_error(error);
+                }
+                num_threads = value;
+                break;
+            case 'r':
+                raw_mode = 1;
+                break;
+            case 'S':
+                stream_mode = 1;
                 break;
-            case 'v':
-                volume = parse_float_opt(optarg, "Amplitude",
-                                         (long double)100 / INT16_MAX, 100);
+            case 'L':
+                serve_path = optarg;
+                break;
+            case 'B':
+                batch_path = optarg;
+                break;
+            case 'N':
+                score_path = optarg;
+                break;
+            case 'V':
+                if(parse_int_opt(optarg, "Voices", 1, UINT16_MAX, &value,
+                                 error)) {
+                    usage_error(error);
+                }
+                num_voices = value;
                 break;
-            case 's':
-                sample_rate = parse_int_opt(optarg, "Sample rate", 1,
-                                            UINT32_MAX);
+            case 'X':
+                if(!strcmp(optarg, "oldest")) {
+                    steal_policy = STEAL_OLDEST;
+                } else if(!strcmp(optarg, "quietest")) {
+                    steal_policy = STEAL_QUIETEST;
+                } else {
+                    usage_error("Voice to steal must be one of 'oldest' or "
+                                "'quietest'.");
+                }
                 break;
-            case 'w':
-                process_wave_opt(optarg);
+            case 'C':
+                cache_dir = optarg;
                 break;
-            case 'o':
-                num_overtones = parse_int_opt(optarg, "Overtones", 0,
-                    INT8_MAX);
+            case 'M':
+                if(parse_int_opt(optarg, "Cache size", 1, UINT32_MAX, &value,
+                                 error)) {
+                    usage_error(error);
+                }
+                cache_megabytes = value;
                 break;
             case '?':
                 usage(1);
             case 'h':
                 usage(0);
             default:
-                fprintf(stderr, "%s: Unrecognized getopt() return value: %c.\n",
-                        program_name, c);
-                usage(1);
+                if(!strchr(request_options, c)) {
+                    fprintf(stderr, "%s: Unrecognized getopt() return value: "
+                            "%c.\n", program_name, c);
+                    usage(1);
+                }
+                if(process_sound_opt(c, optarg, &params, &duration, error)) {
+                    usage_error(error);
+                }
+                duration_given |= (c == 'd');
         }
     }
 }
 
+/**
+ *  Applies the option <c>, with the argument <arg>, to <params> or <duration>.
+ *  These are the options that describe the sound itself, which requests to the
+ *  server share with the command line.
+ *  Returns 0 on success, or -1 with the reason in <error>.
+**/
+int process_sound_opt(int c, const char *arg, struct sound_params *params,
+                      uint32_t *duration, char *error) {
+    long value;
+    switch(c) {
+        case 'd':
+            if(parse_int_opt(arg, "Duration", 1, UINT32_MAX, &value, error)) {
+                return -1;
+            }
+            *duration = value;
+            return 0;
+        case 'v':
+            return parse_float_opt(arg, "Amplitude",
+                                   (long double)100 / INT16_MAX, 100,
+                                   &params->volume, error);
+        case 's':
+            if(parse_int_opt(arg, "Sample rate", 1, UINT32_MAX, &value,
+                             error)) {
+                return -1;
+            }
+            params->sample_rate = value;
+            return 0;
+        case 'w':
+            return process_wave_opt(arg, params, error);
+        case 'o':
+            if(parse_int_opt(arg, "Overtones", 0, UINT16_MAX, &value, error)) {
+                return -1;
+            }
+            params->overtones = value;
+            return 0;
+        case 'W':
+            return process_wavetable_opt(arg, params, error);
+        case 'k':
+            return process_sine_opt(arg, params, error);
+        case 'p':
+            return process_precision_opt(arg, params, error);
+        case 'A':
+            return process_additive_opt(arg, params, error);
+        case 'O':
+            return process_oversample_opt(arg, params, error);
+        case 'E':
+            return process_envelope_opt(arg, params, error);
+        case 'c':
+            return process_curve_opt(arg, params, error);
+        default:
+            snprintf(error, ERROR_SIZE, "Unrecognized option: %c.", c);
+            return -1;
+    }
+}
+
 /**
  *  Processes a command-line wave function specification.
 **/
-void process_wave_opt(const char *opt) {
+int process_wave_opt(const char *opt, struct sound_params *params,
+                     char *error) {
     if(!strcmp(opt, "sine")) {
-        wave_function = sine_wave_function;
+        params->wave = SOUND_WAVE_SINE;
     }else if(!strcmp(opt, "square")) {
-        wave_function = square_wave_function;
+        params->wave = SOUND_WAVE_SQUARE;
     } else if(!strcmp(opt, "triangle")) {
-        wave_function = triangle_wave_function;
+        params->wave = SOUND_WAVE_TRIANGLE;
     } else if(!strcmp(opt, "sawtooth")) {
-        wave_function = sawtooth_wave_function;
+        params->wave = SOUND_WAVE_SAWTOOTH;
     } else if(!strcmp(opt, "point")) {
-        wave_function = point_wave_function;
+        params->wave = SOUND_WAVE_POINT;
     } else if(!strcmp(opt, "circle")) {
-        wave_function = circle_wave_function;
+        params->wave = SOUND_WAVE_CIRCLE;
+    } else if(!strcmp(opt, "polyblep-square")) {
+        params->wave = SOUND_WAVE_POLYBLEP_SQUARE;
+    } else if(!strcmp(opt, "polyblep-sawtooth")) {
+        params->wave = SOUND_WAVE_POLYBLEP_SAWTOOTH;
+    } else if(!strcmp(opt, "polyblep-triangle")) {
+        params->wave = SOUND_WAVE_POLYBLEP_TRIANGLE;
     }  else {
-        fprintf(stderr, "%s: Wave function must be one of 'sine', 'square', "
-                "'triangle', 'sawtooth', 'point', or 'circle'.\n",
-                program_name);
-        usage(1);
+        snprintf(error, ERROR_SIZE, "Wave function must be one of 'sine', "
+                 "'square', 'triangle', 'sawtooth', 'point', 'circle', "
+                 "'polyblep-square', 'polyblep-sawtooth', or "
+                 "'polyblep-triangle'.");
+        return -1;
     }
+    return 0;
 }
 
 /**
- *  Parses <opt> as a long, then returns its value.
- *  <optname> is the name of the option, should an error occur, and <optmin> and
- *  <optmax> are the lower and upper bounds for allowed result values.
+ *  Processes a command-line wavetable mode specification.
 **/
-long parse_int_opt(const char *opt, const char *optname, long optmin,
-                   long optmax) {
-    char *c;
-    errno = 0;
-    long result = strtol(opt, &c, 10);
-    if(errno && errno != ERANGE) {
-        perror(program_name);
-        usage(1);
-    } else if(*c) {
-        fprintf(stderr, "%s: %s must be an integer.\n", program_name, optname);
-        usage(1);
-    } else if(errno == ERANGE || result < optmin || result > optmax) {
-        fprintf(stderr, "%s: %s must be in the range [%ld, %ld].\n",
-                program_name, optname, optmin, optmax);
-        usage(1);
+int process_wavetable_opt(const char *opt, struct sound_params *params,
+                          char *error) {
+    if(!strcmp(opt, "off")) {
+        params->wavetable = SOUND_WAVETABLE_OFF;
+    } else if(!strcmp(opt, "linear")) {
+        params->wavetable = SOUND_WAVETABLE_LINEAR;
+    } else if(!strcmp(opt, "cubic")) {
+        params->wavetable = SOUND_WAVETABLE_CUBIC;
     } else {
-        return result;
+        snprintf(error, ERROR_SIZE, "Wavetable mode must be one of 'off', "
+                 "'linear', or 'cubic'.");
+        return -1;
     }
-    // Should never happen, but put here to silence compiler warnings.
-    fprintf(stderr, "%s: Fatal error encountered. Exiting...\n", program_name);
-    exit(1);
+    return 0;
 }
 
 /**
- *  Parses <opt> as a long double, then returns its value.
- *  <optname> is the name of the option, should an error occur, and <optmin> and
- *  <optmax> are the inclusive lower and upper bounds for allowed result values.
+ *  Processes a command-line sine kernel specification.
 **/
-long double parse_float_opt(const char *opt, const char *optname,
-                            long double optmin, long double optmax) {
-    char *c;
-    errno = 0;
-    long double result = strtold(opt, &c);
-    if(errno && errno != ERANGE) {
-        perror(program_name);
-        usage(1);
-    } else if(*c) {
-        fprintf(stderr, "%s: %s must be a number.\n", program_name, optname);
-        usage(1);
-    } else if(errno == ERANGE || result < optmin || result > optmax) {
-        fprintf(stderr, "%s: %s must be in the range [%Lf, %Lf].\n",
-                program_name, optname, optmin, optmax);
-        usage(1);
+int process_sine_opt(const char *opt, struct sound_params *params,
+                     char *error) {
+    if(!strcmp(opt, "polynomial")) {
+        params->sine_kernel = SOUND_SINE_POLYNOMIAL;
+    } else if(!strcmp(opt, "rotation")) {
+        params->sine_kernel = SOUND_SINE_ROTATION;
     } else {
-        return result;
+        snprintf(error, ERROR_SIZE, "Sine kernel must be one of 'polynomial' "
+                 "or 'rotation'.");
+        return -1;
     }
-    // Should never happen, but put here to silence compiler warnings.
-    fprintf(stderr, "%s: Fatal error encountered. Exiting...\n", program_name);
-    exit(1);
+    return 0;
 }
 
 /**
- *  Returns the number of samples required to cover <duration> milliseconds,
- *  accounting for possible truncation.
- *  If an overflow would occur, print an error message and exit.
+ *  Processes a command-line precision specification.
 **/
-uint32_t get_num_samples(uint32_t duration) {
-    uint32_t low, high;
-    if(duration > sample_rate) {
-        low = sample_rate;
-        high = duration;
+int process_precision_opt(const char *opt, struct sound_params *params,
+                          char *error) {
+    if(!strcmp(opt, "float")) {
+        params->precision = SOUND_PRECISION_FLOAT;
+    } else if(!strcmp(opt, "double")) {
+        params->precision = SOUND_PRECISION_DOUBLE;
+    } else if(!strcmp(opt, "long-double")) {
+        params->precision = SOUND_PRECISION_LONG_DOUBLE;
+    } else if(!strcmp(opt, "q31")) {
+        params->precision = SOUND_PRECISION_Q31;
     } else {
-        low = duration;
-        high = sample_rate;
-    }
-    if(low / 1000 > UINT32_MAX / high) {
-        fprintf(stderr, "%s: Duration of %u and sample rate of %u would  "
-                        "combine to create a file that is too large to store "
-                        "in WAVE format.\n", program_name, duration,
-                        sample_rate);
-        exit(1);
-    } else if(low > UINT32_MAX / high) {
-        return ((high / 1000) + 1) * low;
-    } else {
-        return ((high * low) / 1000) + 1;
+        snprintf(error, ERROR_SIZE, "Precision must be one of 'float', "
+                 "'double', 'long-double', or 'q31'.");
+        return -1;
     }
+    return 0;
 }
 
 /**
- *  Write <num_samples> samples for each pitch in the array <frequencies> of
- *  length <num_crequencies> with a maximum value of <volume> and a given
- *  <wave_function>.
+ *  Processes a command-line additive engine specification.
 **/
-void write_samples(long double *frequencies, uint8_t num_frequencies,
-                   long double volume, uint32_t num_samples,
-                   long double (*wave_function)(long double, uint32_t)) {
-    for(uint32_t t = 0; t < num_samples; t++) {
-        long double sample = 0;
-        for(uint8_t f = 0; f < num_frequencies; f++) {
-            sample += ((volume / 100) * INT16_MAX *
-                      wave_function(frequencies[f], t)) / num_frequencies;
-        }
-        write_int_data((int16_t)sample, 2);
+int process_additive_opt(const char *opt, struct sound_params *params,
+                         char *error) {
+    if(!strcmp(opt, "auto")) {
+        params->additive = SOUND_ADDITIVE_AUTO;
+    } else if(!strcmp(opt, "direct")) {
+        params->additive = SOUND_ADDITIVE_DIRECT;
+    } else if(!strcmp(opt, "inverse-fft")) {
+        params->additive = SOUND_ADDITIVE_INVERSE_FFT;
+    } else {
+        snprintf(error, ERROR_SIZE, "Additive engine must be one of 'auto', "
+                 "'direct', or 'inverse-fft'.");
+        return -1;
     }
+    return 0;
 }
 
 /**
- *  Returns a sample of the sine wave of a given frequency at a given time.
+ *  Processes a command-line oversampling factor specification.
 **/
-long double sine_wave_function(long double frequency, uint32_t time) {
-    long double x = (2 * PI * time * frequency) / sample_rate;
-    return sinl(x);
+int process_oversample_opt(const char *opt, struct sound_params *params,
+                           char *error) {
+    if(!strcmp(opt, "1")) {
+        params->oversample = 1;
+    } else if(!strcmp(opt, "2")) {
+        params->oversample = 2;
+    } else if(!strcmp(opt, "4")) {
+        params->oversample = 4;
+    } else if(!strcmp(opt, "8")) {
+        params->oversample = 8;
+    } else {
+        snprintf(error, ERROR_SIZE, "Oversampling factor must be one of 1, 2, "
+                 "4, or 8.");
+        return -1;
+    }
+    return 0;
 }
 
 /**
- *  Returns a sample of the square wave of a given frequency at a given time.
+ *  Processes a command-line envelope specification: the attack, decay and
+ *  release in milliseconds and the sustain as a percentage of the volume,
+ *  separated by commas as "attack,decay,sustain,release".
 **/
-long double square_wave_function(long double frequency, uint32_t time) {
-    long double x = (2 * time * frequency) / sample_rate;
-    return ((size_t)x % 2) ? 1 : -1;
+int process_envelope_opt(const char *opt, struct sound_params *params,
+                         char *error) {
+    enum { ATTACK_FIELD, DECAY_FIELD, SUSTAIN_FIELD, RELEASE_FIELD,
+           NUM_FIELDS };
+    char fields[NUM_FIELDS][ERROR_SIZE / 4];
+    size_t num_fields = 0;
+    for(const char *field = opt;; field++) {
+        size_t length = strcspn(field, ",");
+        if(num_fields == NUM_FIELDS || length >= sizeof(fields[0])) {
+            num_fields = NUM_FIELDS + 1;
+            break;
+        }
+        memcpy(fields[num_fields], field, length);
+        fields[num_fields++][length] = '\0';
+        field += length;
+        if(!*field) {
+            break;
+        }
+    }
+    if(num_fields != NUM_FIELDS) {
+        snprintf(error, ERROR_SIZE, "Envelope must be given as "
+                 "attack,decay,sustain,release.");
+        return -1;
+    }
+    long attack, decay, release;
+    long double sustain;
+    if(parse_int_opt(fields[ATTACK_FIELD], "Attack", 0, UINT32_MAX, &attack,
+                     error) ||
+       parse_int_opt(fields[DECAY_FIELD], "Decay", 0, UINT32_MAX, &decay,
+                     error) ||
+       parse_float_opt(fields[SUSTAIN_FIELD], "Sustain", 0, 100, &sustain,
+                       error) ||
+       parse_int_opt(fields[RELEASE_FIELD], "Release", 0, UINT32_MAX,
+                     &release, error)) {
+        return -1;
+    }
+    params->attack = attack;
+    params->decay = decay;
+    params->sustain = sustain;
+    params->release = release;
+    return 0;
 }
 
 /**
- *  Returns a sample of the triangle wave of a given frequency at a given time.
+ *  Processes a command-line envelope curve specification.
 **/
-long double triangle_wave_function(long double frequency, uint32_t time) {
-    long double x = (4 * time * frequency) / sample_rate;
-    return (x - (2 * floor((x + 1) / 2))) *
-           (((size_t)((x + 1) / 2) % 2) ? -1 : 1);
+int process_curve_opt(const char *opt, struct sound_params *params,
+                      char *error) {
+    if(!strcmp(opt, "linear")) {
+        params->curve = SOUND_CURVE_LINEAR;
+    } else if(!strcmp(opt, "exponential")) {
+        params->curve = SOUND_CURVE_EXPONENTIAL;
+    } else {
+        snprintf(error, ERROR_SIZE, "Curve must be one of 'linear' or "
+                 "'exponential'.");
+        return -1;
+    }
+    return 0;
 }
 
 /**
- *  Returns a sample of the sawtooth wave of a given frequency at a given time.
+ *  Parses <opt> as a long into <result>.
+ *  <optname> is the name of the option, should an error occur, and <optmin> and
+ *  <optmax> are the lower and upper bounds for allowed result values.
+ *  Returns 0 on success, or -1 with the reason in <error>.
 **/
-long double sawtooth_wave_function(long double frequency, uint32_t time) {
-    long double x = (time * frequency) / sample_rate;
-    return 2 * (x - floor(x)) - 1;
+int parse_int_opt(const char *opt, const char *optname, long optmin,
+                  long optmax, long *result, char *error) {
+    char *c;
+    errno = 0;
+    long value = strtol(opt, &c, 10);
+    if(errno && errno != ERANGE) {
+        snprintf(error, ERROR_SIZE, "%s.", strerror(errno));
+    } else if(*c) {
+        snprintf(error, ERROR_SIZE, "%s must be an integer.", optname);
+    } else if(errno == ERANGE || value < optmin || value > optmax) {
+        snprintf(error, ERROR_SIZE, "%s must be in the range [%ld, %ld].",
+                 optname, optmin, optmax);
+    } else {
+        *result = value;
+        return 0;
+    }
+    return -1;
 }
 
 /**
- *  Returns a sample of a point wave of a given frequency at a given time.
+ *  Parses <opt> as a long double into <result>.
+ *  <optname> is the name of the option, should an error occur, and <optmin> and
+ *  <optmax> are the inclusive lower and upper bounds for allowed result values.
+ *  Returns 0 on success, or -1 with the reason in <error>.
 **/
-long double point_wave_function(long double frequency, uint32_t time) {
-    long double x = (4 * time * frequency) / sample_rate;
-    long double root = x - (1 + (floor(x / 2) * 2));
-    return (1 - sqrt(1 - (root * root))) *
-           (((size_t)((x + 1) / 2) % 2) ? -1 : 1);
+int parse_float_opt(const char *opt, const char *optname, long double optmin,
+                    long double optmax, long double *result, char *error) {
+    char *c;
+    errno = 0;
+    long double value = strtold(opt, &c);
+    if(errno && errno != ERANGE) {
+        snprintf(error, ERROR_SIZE, "%s.", strerror(errno));
+    } else if(*c) {
+        snprintf(error, ERROR_SIZE, "%s must be a number.", optname);
+    } else if(errno == ERANGE || value < optmin || value > optmax) {
+        snprintf(error, ERROR_SIZE, "%s must be in the range [%Lf, %Lf].",
+                 optname, optmin, optmax);
+    } else {
+        *result = value;
+        return 0;
+    }
+    return -1;
 }
 
 /**
- *  Returns a sample of a circle wave of a given frequency at a given time.
+ *  Checks for the combinations of options in <params> that sound_create()
+ *  would refuse without saying why.
+ *  Returns 0 if there are none, or -1 with the reason in <error>.
 **/
-long double circle_wave_function(long double frequency, uint32_t time) {
-    long double x = (4 * time * frequency) / sample_rate;
-    long double root = x - (floor(x / 2) * 2) - 1;
-    return sqrt(1 - (root * root)) * (((size_t)((x + 1) / 2) % 2) ? -1 : 1);
+int check_params(const struct sound_params *params, char *error) {
+    if(params->additive == SOUND_ADDITIVE_INVERSE_FFT &&
+       (params->wave != SOUND_WAVE_SINE ||
+        params->wavetable != SOUND_WAVETABLE_OFF)) {
+        snprintf(error, ERROR_SIZE, "The inverse FFT engine only renders sine "
+                 "waves, without a wavetable.");
+        return -1;
+    }
+    return 0;
 }
 
-
 /**
- *  Prepare to write <data_length> samples to the output file.
+ *  Returns the number of samples required to cover <duration> milliseconds at
+ *  <sample_rate>, accounting for possible truncation.
+ *  Both factors fit in 32 bits, so their product can't overflow 64.
 **/
-void create_sound_file(uint32_t data_length) {
-    uint32_t subchunk2_size = data_length * NUM_CHANNELS * BITS_PER_SAMPLE / 8;
-    checked_fprintf(out, "%s", CHUNK_ID);
-    write_int_data(36 + subchunk2_size, CHUNK_SIZE_SIZE);
-    checked_fprintf(out, "%s", FORMAT);
-    checked_fprintf(out, "%s", SUBCHUNK1_ID);
-    write_int_data(SUBCHUNK1_SIZE, SUBCHUNK1_SIZE_SIZE);
-    write_int_data(AUDIO_FORMAT, AUDIO_FORMAT_SIZE);
-    write_int_data(NUM_CHANNELS, NUM_CHANNELS_SIZE);
-    write_int_data(sample_rate, SAMPLE_RATE_SIZE);
-    write_int_data(BYTE_RATE, BYTE_RATE_SIZE);
-    write_int_data(BLOCK_ALIGN, BLOCK_ALIGN_SIZE);
-    write_int_data(BITS_PER_SAMPLE, BITS_PER_SAMPLE_SIZE);
-    checked_fprintf(out, "%s", SUBCHUNK2_ID);
-    write_int_data(subchunk2_size, SUBCHUNK2_SIZE_SIZE);
+uint64_t get_num_samples(uint32_t duration, uint32_t sample_rate) {
+    return (((uint64_t)duration * sample_rate) / 1000) + 1;
 }
 
-
 /**
- *  Prepare to write <new_data_length> samples to the end of hte output file,
- *  by erifying and then adjusting the header as needed.
+ *  Write <num_samples> samples of <sound>, using <num_threads> threads. The
+ *  samples go straight into <destination> if it isn't NULL, and to the output
+ *  file otherwise.
+ *  Samples are rendered RENDER_BLOCK_SIZE at a time, so that each block
+ *  reaches the output with a single write.
+ *  If the sound repeats itself within the first half of its length, only
+ *  that first period is rendered and the rest of the sound is copied from it.
 **/
-void append_sound_file(uint32_t new_data_length) {
-    // How much larger is the data chunk going to get?
-    uint32_t subchunk2_size_addition = new_data_length * NUM_CHANNELS *
-                                       BITS_PER_SAMPLE / 8;
-
-    // How large was the previous data chunk?
-    checked_fseek(out, CHUNK_SIZE_OFFSET, SEEK_SET);
-    uint32_t prev_subchunk2_size = read_int_data(out, CHUNK_SIZE_SIZE) - 36;
-
-    // Make sure that all header fields are the expected values before rewriting
-    // any of them.
-    verify_string_header("Chunk ID", CHUNK_ID, CHUNK_ID_OFFSET, CHUNK_ID_SIZE);
-    verify_string_header("Format", FORMAT, FORMAT_OFFSET, FORMAT_SIZE);
-    verify_string_header("Subchunk 1 ID", SUBCHUNK1_ID, SUBCHUNK1_ID_OFFSET,
-                         SUBCHUNK1_ID_SIZE);
-    verify_int_header("Subchunk 1 size", SUBCHUNK1_SIZE, SUBCHUNK1_SIZE_OFFSET,
-                      SUBCHUNK1_SIZE_SIZE);
-    verify_int_header("Audio format", AUDIO_FORMAT, AUDIO_FORMAT_OFFSET,
-                      AUDIO_FORMAT_SIZE);
-    verify_int_header("Number of channels", NUM_CHANNELS, NUM_CHANNELS_OFFSET,
-                      NUM_CHANNELS_SIZE);
-    verify_int_header("Sample rate", sample_rate, SAMPLE_RATE_OFFSET,
-                      SAMPLE_RATE_SIZE);
-    verify_int_header("Byte rate", BYTE_RATE, BYTE_RATE_OFFSET, BYTE_RATE_SIZE);
-    verify_int_header("Block align", BLOCK_ALIGN, BLOCK_ALIGN_OFFSET,
-                      BLOCK_ALIGN_SIZE);
-    verify_int_header("Bits per sample", BITS_PER_SAMPLE,
-                      BITS_PER_SAMPLE_OFFSET, BITS_PER_SAMPLE_SIZE);
-    verify_string_header("Subchunk 2 ID", SUBCHUNK2_ID, SUBCHUNK2_ID_OFFSET,
-                         SUBCHUNK2_ID_SIZE);
-    verify_int_header("Subchunk 2 size", prev_subchunk2_size,
-                      SUBCHUNK2_SIZE_OFFSET, SUBCHUNK2_SIZE_SIZE);
-
-    // Update fields dependent on the size of the data chunk--namely, the Chunk
-    // Size and Subchunk2 Size fields.
-    checked_fseek(out, CHUNK_SIZE_OFFSET, SEEK_SET);
-    write_int_data(prev_subchunk2_size + subchunk2_size_addition + 36,
-                 CHUNK_SIZE_SIZE);
-    checked_fseek(out, SUBCHUNK2_SIZE_OFFSET, SEEK_SET);
-    write_int_data((new_data_length * NUM_CHANNELS * BITS_PER_SAMPLE / 8) +
-                   prev_subchunk2_size, SUBCHUNK2_SIZE_SIZE);
-
-    // Prepare to write the new data, beginning at the end of the existing data
-    // chunk.
-    checked_fseek(out, DATA_OFFSET + prev_subchunk2_size, SEEK_SET);
-}
-
-/**
- *  Checks to make sure that the header of <file> matches the given number
- *  <field> of <size> bytes at the given position <offset>.
-**/
-void verify_int_header(const char *field_name, size_t field, size_t offset,
-                       uint8_t size) {
-    checked_fseek(out, offset, SEEK_SET);
-    size_t value = read_int_data(out, size);
-    if(field != value) {
-        fprintf(stderr, "%s: %s: Header field '%s' appears to be corrupted.\n",
-                program_name, out_name, field_name);
-        fprintf(stderr, "Expected value: %zu; encountered value: %zu.\n",
-                field, value);
-        exit(1);
+void write_samples(struct sound *sound, uint64_t num_samples,
+                   uint16_t num_threads, uint8_t *destination) {
+    struct render_job job = {
+        .sound = sound,
+        .num_samples = num_samples,
+        .destination = destination
+    };
+    uint64_t period = sound_period(sound);
+    if(period && period <= num_samples / 2) {
+        write_samples_tiled(&job, period);
+    } else if(num_threads > 1 && num_samples > RENDER_CHUNK_SIZE) {
+        write_samples_threaded(&job, num_threads);
+    } else if(destination) {
+        sound_render_pcm16(sound, destination, 0, num_samples);
+    } else {
+        static uint8_t bytes[RENDER_BLOCK_SIZE * BLOCK_ALIGN];
+        for(uint64_t t = 0; t < num_samples; t += RENDER_BLOCK_SIZE) {
+            size_t block_size = (num_samples - t < RENDER_BLOCK_SIZE) ?
+                                num_samples - t : RENDER_BLOCK_SIZE;
+            sound_render_pcm16(sound, bytes, t, block_size);
+            checked_fwrite(bytes, block_size * BLOCK_ALIGN, out);
+        }
     }
+    sound_advance(sound, num_samples);
 }
 
 /**
- *  Checks to make sure that the header of <file> matches the given string
- *  <field> of <size> bytes at the given position <offset>.
+ *  Write samples of <sound> until a signal asks for a stop or, if
+ *  <max_samples> is nonzero, that many samples have been written.
+ *  The sound is advanced after every block, so memory use stays the same
+ *  however long the stream runs.
 **/
-void verify_string_header(const char *field_name, const char *field,
-                          size_t offset, size_t size) {
-    checked_fseek(out, offset, SEEK_SET);
-    char buf[size];
-    if(fread(buf, sizeof(char), size, out) <= 0) {
-        fprintf(stderr, "%s: %s: Read failed.\n", program_name, out_name);
-        exit(1);
+void stream_samples(struct sound *sound, uint64_t max_samples) {
+    struct render_job job = {
+        .sound = sound,
+        .num_samples = max_samples
+    };
+    uint64_t period = sound_period(sound);
+    if(period && (!max_samples || period <= max_samples / 2)) {
+        sound_advance(sound, write_samples_tiled(&job, period));
+        return;
     }
-    if(strncmp(buf, field, size)) {
-        fprintf(stderr, "%s: %s: Header field '%s' appears to be corrupted.\n",
-                program_name, out_name, field_name);
-        fprintf(stderr, "Expected value: \"%s\"; encountered value: \"%s\".\n",
-                field, buf);
-        exit(1);
+    static uint8_t bytes[RENDER_BLOCK_SIZE * BLOCK_ALIGN];
+    for(uint64_t t = 0; !stop_requested && (!max_samples || t < max_samples);) {
+        size_t block_size = RENDER_BLOCK_SIZE;
+        if(max_samples && max_samples - t < RENDER_BLOCK_SIZE) {
+            block_size = max_samples - t;
+        }
+        sound_render_pcm16(sound, bytes, 0, block_size);
+        checked_fwrite(bytes, block_size * BLOCK_ALIGN, out);
+        sound_advance(sound, block_size);
+        t += block_size;
     }
 }
 
 /**
- *  Write <num_bytes> of the integer given in <data> to the output file byte by
- *  byte in ascending order from least to most significant bytes.
+ *  Signal handler that ends a stream once the block in progress is written.
 **/
-void write_int_data(size_t data, uint8_t num_bytes) {
-    for(uint8_t i = 0; i < num_bytes; i++, data >>= CHAR_BIT) {
-        checked_fputc(data & UCHAR_MAX, out);
-    }
+void request_stop(int signal) {
+    (void)signal;
+    stop_requested = 1;
 }
 
 /**
- *  Attempts to read <num_bytes> bytes from <file>, and convert their values to
- *  an unsigned integer assuming they are in ascending order from least to most
- *  significant byte.
+ *  Routes SIGINT and SIGTERM to request_stop(), so that an interrupted stream
+ *  still gets its header finished.
 **/
-size_t read_int_data(FILE *file, uint8_t num_bytes) {
-    size_t result = 0;
-    for(uint8_t i = 0; i < num_bytes; i++) {
-        size_t byte = checked_fgetc(file);
-        result += byte << (CHAR_BIT * i);
+void install_stop_handler(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+/**
+ *  Splits <job> into chunks of RENDER_CHUNK_SIZE samples and renders them on
+ *  <num_threads> threads.
+ *  If the job has a destination in memory, every thread renders its chunks
+ *  straight into it. If the output is a regular file, every thread pwrite()s
+ *  its chunks straight to their final position. Otherwise (pipes, terminals,
+ *  ...) finished chunks are parked in a ring of slots and written in order by
+ *  the calling thread; a thread may only start on a chunk once the one that
+ *  last used its slot has been written, which keeps memory use bounded.
+**/
+void write_samples_threaded(struct render_job *job, uint16_t num_threads) {
+    struct stat info;
+    job->fd = -1;
+    if(!job->destination) {
+        checked_fflush(out);
+    }
+    if(!job->destination && !fstat(fileno(out), &info) &&
+       S_ISREG(info.st_mode)) {
+        job->fd = fileno(out);
+        job->data_offset = checked_ftell(out);
+    }
+    job->num_chunks = (job->num_samples + RENDER_CHUNK_SIZE - 1) /
+                      RENDER_CHUNK_SIZE;
+    job->next_chunk = 0;
+    job->next_write = 0;
+    job->num_slots = 2 * num_threads;
+    job->slots = checked_malloc(job->num_slots * RENDER_CHUNK_SIZE *
+                                BLOCK_ALIGN);
+    job->slot_chunks = checked_malloc(job->num_slots *
+                                      sizeof(*job->slot_chunks));
+    for(size_t s = 0; s < job->num_slots; s++) {
+        job->slot_chunks[s] = UINT64_MAX;
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+
+    // When writing in place, the calling thread has nothing to wait for, so
+    // it renders chunks alongside the others.
+    uint8_t in_place = job->destination || job->fd >= 0;
+    uint16_t num_workers = in_place ? num_threads - 1 : num_threads;
+    pthread_t workers[num_workers];
+    for(uint16_t w = 0; w < num_workers; w++) {
+        if(pthread_create(&workers[w], NULL, render_worker, job)) {
+            fprintf(stderr, "%s: Failed to create render thread.\n",
+                    program_name);
+            exit(1);
+        }
+    }
+    if(in_place) {
+        render_worker(job);
+    } else {
+        for(uint64_t c = 0; c < job->num_chunks; c++) {
+            size_t s = c % job->num_slots;
+            pthread_mutex_lock(&job->lock);
+            while(job->slot_chunks[s] != c) {
+                pthread_cond_wait(&job->cond, &job->lock);
+            }
+            pthread_mutex_unlock(&job->lock);
+            checked_fwrite(job->slots + s * RENDER_CHUNK_SIZE * BLOCK_ALIGN,
+                           chunk_size(job, c) * BLOCK_ALIGN, out);
+            pthread_mutex_lock(&job->lock);
+            job->slot_chunks[s] = UINT64_MAX;
+            job->next_write++;
+            pthread_cond_broadcast(&job->cond);
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    for(uint16_t w = 0; w < num_workers; w++) {
+        pthread_join(workers[w], NULL);
+    }
+
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+    free(job->slot_chunks);
+    free(job->slots);
+    if(job->fd >= 0) {
+        checked_fseek(out, job->data_offset +
+                      (long)job->num_samples * BLOCK_ALIGN, SEEK_SET);
     }
-    return result;
 }
 
 /**
- *  Writes <byte> to <file>. If failure is detected, prints an error message and
- *  exits the program.
+ *  Body of each thread started by write_samples_threaded(). Claims chunks of
+ *  <job> in order until none are left, rendering each one and then either
+ *  writing it in place or handing it over to the writing thread.
 **/
-void checked_fputc(uint8_t byte, FILE *file) {
-    if(fputc(byte, file) == EOF) {
-        fprintf(stderr, "%s: %s: Write failed.\n", program_name, out_name);
-        exit(1);
+void *render_worker(void *arg) {
+    struct render_job *job = arg;
+    uint8_t in_place = job->destination || job->fd >= 0;
+    uint8_t *own_bytes = (job->fd >= 0) ?
+                         checked_malloc(RENDER_CHUNK_SIZE * BLOCK_ALIGN) : NULL;
+    for(;;) {
+        pthread_mutex_lock(&job->lock);
+        uint64_t c = job->next_chunk++;
+        while(c < job->num_chunks && !in_place &&
+              c >= job->next_write + job->num_slots) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        pthread_mutex_unlock(&job->lock);
+        if(c >= job->num_chunks) {
+            break;
+        }
+
+        size_t s = c % job->num_slots;
+        uint64_t first = c * RENDER_CHUNK_SIZE;
+        uint8_t *bytes = job->destination ?
+                         job->destination + first * BLOCK_ALIGN :
+                         own_bytes ? own_bytes :
+                         job->slots + s * RENDER_CHUNK_SIZE * BLOCK_ALIGN;
+        size_t size = chunk_size(job, c);
+        sound_render_pcm16(job->sound, bytes, first, size);
+
+        if(job->destination) {
+            continue;
+        } else if(job->fd >= 0) {
+            checked_pwrite(job->fd, bytes, size * BLOCK_ALIGN,
+                           job->data_offset + (off_t)first * BLOCK_ALIGN);
+        } else {
+            pthread_mutex_lock(&job->lock);
+            job->slot_chunks[s] = c;
+            pthread_cond_broadcast(&job->cond);
+            pthread_mutex_unlock(&job->lock);
+        }
     }
+    free(own_bytes);
+    return NULL;
 }
 
 /**
- *  Calls fprintf on <file> with all supplied arguments. If failure is detected,
- *  prints an error message and exits the program.
+ *  Returns the number of samples in chunk <c> of <job>; all but the last are
+ *  RENDER_CHUNK_SIZE long.
 **/
-void checked_fprintf(FILE *file, const char *format, ...) {
-    va_list arg_list;
-    va_start(arg_list, format);
-    if(vfprintf(file, format, arg_list) < 0) {
-        va_end(arg_list);
-        fprintf(stderr, "%s: %s: Write failed.\n", program_name, out_name);
-        exit(1);
+size_t chunk_size(const struct render_job *job, uint64_t c) {
+    uint64_t first = c * RENDER_CHUNK_SIZE;
+    return (job->num_samples - first < RENDER_CHUNK_SIZE) ?
+           job->num_samples - first : RENDER_CHUNK_SIZE;
+}
+
+/**
+ *  Writes the samples of <job>, whose partials all come back to where they
+ *  started every <period> samples, by rendering a single period and copying
+ *  it. A job with no <num_samples> goes on until a signal asks for a stop.
+ *  Returns the number of samples written.
+**/
+uint64_t write_samples_tiled(const struct render_job *job, uint64_t period) {
+    if(job->destination) {
+        render_tile(job, job->destination, period, job->num_samples);
+        return job->num_samples;
+    }
+    // Short periods are repeated up to about a chunk, so that the output still
+    // gets written in large pieces.
+    uint64_t span = (period < RENDER_CHUNK_SIZE) ?
+                    RENDER_CHUNK_SIZE / period * period : period;
+    if(job->num_samples && span > job->num_samples) {
+        span = job->num_samples;
     }
-    va_end(arg_list);
+    uint8_t *tile = checked_malloc(span * BLOCK_ALIGN);
+    render_tile(job, tile, period, span);
+    uint64_t t = 0;
+    while(!stop_requested && (!job->num_samples || t < job->num_samples)) {
+        uint64_t n = (job->num_samples && job->num_samples - t < span) ?
+                     job->num_samples - t : span;
+        checked_fwrite(tile, n * BLOCK_ALIGN, out);
+        t += n;
+    }
+    free(tile);
+    return t;
 }
 
 /**
- *  Attempts to read a byte from <file>, and return it. If failure is detected,
- *  prints an error message and exits the program.
+ *  Renders the first <period> samples of <job> into <bytes>, then fills the
+ *  rest of its <span> samples by copying them, doubling the copied stretch
+ *  each time.
 **/
-uint8_t checked_fgetc(FILE *file) {
-    int result = fgetc(file);
-    if(result == EOF) {
-        fprintf(stderr, "%s: %s: Read failed.\n", program_name, out_name);
+void render_tile(const struct render_job *job, uint8_t *bytes, uint64_t period,
+                 uint64_t span) {
+    sound_render_pcm16(job->sound, bytes, 0, period);
+    for(uint64_t filled = period; filled < span; filled *= 2) {
+        uint64_t n = (span - filled < filled) ? span - filled : filled;
+        memcpy(bytes + filled * BLOCK_ALIGN, bytes, n * BLOCK_ALIGN);
     }
-    return (uint8_t)result;
 }
 
 /**
- *  Attempts to perform a call to fseek with the provided arguments. If failure
- *  is detected, prints an error message and exists the program.
+ *  Hands the first <num_samples> samples of <sound> to <emit>, along with
+ *  <target>, a piece at a time, the same samples write_samples() would write.
+ *  <bytes> has room for RENDER_BLOCK_SIZE samples.
+ *  Returns 0 on success, or -1 as soon as <emit> does.
 **/
-void checked_fseek(FILE *file, long offset, int whence) {
-    if(fseek(file, offset, whence)) {
-        fprintf(stderr, "%s: %s: Seek failed.\n", program_name, out_name);
+int emit_samples(const struct sound *sound, uint64_t num_samples,
+                 uint8_t *bytes, int (*emit)(void *, const void *, size_t),
+                 void *target) {
+    uint64_t period = sound_period(sound);
+    if(period && period <= num_samples / 2) {
+        struct render_job job = {.sound = sound};
+        uint64_t span = (period < RENDER_BLOCK_SIZE) ?
+                        RENDER_BLOCK_SIZE / period * period : period;
+        uint8_t *tile = (span > RENDER_BLOCK_SIZE) ?
+                        checked_malloc(span * BLOCK_ALIGN) : bytes;
+        render_tile(&job, tile, period, span);
+        int result = 0;
+        for(uint64_t t = 0; !result && t < num_samples; t += span) {
+            uint64_t n = (num_samples - t < span) ? num_samples - t : span;
+            result = emit(target, tile, n * BLOCK_ALIGN);
+        }
+        if(tile != bytes) {
+            free(tile);
+        }
+        return result;
+    }
+    for(uint64_t t = 0; t < num_samples; t += RENDER_BLOCK_SIZE) {
+        size_t block_size = (num_samples - t < RENDER_BLOCK_SIZE) ?
+                            num_samples - t : RENDER_BLOCK_SIZE;
+        sound_render_pcm16(sound, bytes, t, block_size);
+        if(emit(target, bytes, block_size * BLOCK_ALIGN)) {
+            return -1;
+        }
     }
+    return 0;
 }
 
 /**
- *  Close the file stream <out>. Intended for use as an exit
- *  handler.
+ *  Serves requests on a Unix domain socket at <path> until SIGINT or SIGTERM.
+ *  Every request is a line holding the same options and frequencies as the
+ *  command line, on top of the ones the server was started with; the answer
+ *  is a line "OK <size>" followed by that many bytes of .wav file (or raw
+ *  samples, with --raw), or a line "ERROR <reason>". A connection may carry
+ *  any number of requests, one after the other.
+ *  Connections are handed to <num_threads> threads that last as long as the
+ *  server does, and the wavetables built for one request stay around for the
+ *  next.
 **/
-void close_out(void) {
+void serve(const char *path) {
+    struct sockaddr_un address;
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s: %s: Socket path too long.\n", program_name, path);
+        exit(1);
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    // A socket left behind by an earlier server is in the way; anything else
+    // at <path> is left alone, and bind() will complain about it.
+    struct stat info;
+    if(!lstat(path, &info) && S_ISSOCK(info.st_mode)) {
+        unlink(path);
+    }
+    errno = 0;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0 ||
+       bind(listener, (struct sockaddr *)&address, sizeof(address)) ||
+       listen(listener, SERVE_BACKLOG)) {
+        fprintf(stderr, "%s: %s: %s.\n", program_name, path, strerror(errno));
+        exit(1);
+    }
+
+    // SIGINT and SIGTERM stay blocked everywhere but in pselect(), so that a
+    // stop can't slip in between checking for one and waiting for the next
+    // connection.
+    sigset_t stop_signals, unblocked;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &unblocked);
+    install_stop_handler();
+
+    struct server server = {.num_pending = 0, .closing = 0};
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.cond, NULL);
+    server.serving = checked_malloc(num_threads * sizeof(*server.serving));
+    pthread_t workers[num_threads];
+    for(uint16_t w = 0; w < num_threads; w++) {
+        server.serving[w] = -1;
+        if(pthread_create(&workers[w], NULL, serve_worker, &server)) {
+            fprintf(stderr, "%s: Failed to create server thread.\n",
+                    program_name);
+            exit(1);
+        }
+    }
+
+    while(!stop_requested) {
+        fd_set ready;
+        FD_ZERO(&ready);
+        FD_SET(listener, &ready);
+        if(pselect(listener + 1, &ready, NULL, NULL, NULL, &unblocked) < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: %s: %s.\n", program_name, path,
+                    strerror(errno));
+            exit(1);
+        }
+        int fd = accept(listener, NULL, NULL);
+        if(fd < 0) {
+            continue;
+        }
+        pthread_mutex_lock(&server.lock);
+        while(server.num_pending == SERVE_BACKLOG) {
+            pthread_cond_wait(&server.cond, &server.lock);
+        }
+        server.pending[(server.first_pending + server.num_pending++) %
+                       SERVE_BACKLOG] = fd;
+        pthread_cond_broadcast(&server.cond);
+        pthread_mutex_unlock(&server.lock);
+    }
+
+    // Requests already being answered are finished, but nothing more is read
+    // from any connection.
+    pthread_mutex_lock(&server.lock);
+    server.closing = 1;
+    for(; server.num_pending; server.num_pending--) {
+        close(server.pending[server.first_pending++ % SERVE_BACKLOG]);
+    }
+    for(uint16_t w = 0; w < num_threads; w++) {
+        if(server.serving[w] >= 0) {
+            shutdown(server.serving[w], SHUT_RD);
+        }
+    }
+    pthread_cond_broadcast(&server.cond);
+    pthread_mutex_unlock(&server.lock);
+    for(uint16_t w = 0; w < num_threads; w++) {
+        pthread_join(workers[w], NULL);
+    }
+
+    pthread_cond_destroy(&server.cond);
+    pthread_mutex_destroy(&server.lock);
+    free(server.serving);
+    close(listener);
+    unlink(path);
+}
+
+/**
+ *  Body of each thread started by serve(). Takes connections off the queue of
+ *  <server> one at a time and answers every request on each, until the server
+ *  closes.
+**/
+void *serve_worker(void *arg) {
+    struct server *server = arg;
+    for(;;) {
+        pthread_mutex_lock(&server->lock);
+        while(!server->num_pending && !server->closing) {
+            pthread_cond_wait(&server->cond, &server->lock);
+        }
+        if(server->closing) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        int fd = server->pending[server->first_pending++ % SERVE_BACKLOG];
+        server->num_pending--;
+        size_t w = 0;
+        while(server->serving[w] >= 0) {
+            w++;
+        }
+        server->serving[w] = fd;
+        pthread_cond_broadcast(&server->cond);
+        pthread_mutex_unlock(&server->lock);
+
+        FILE *in = fdopen(fd, "r");
+        if(in) {
+            serve_connection(fd, in);
+        }
+
+        // The descriptor can't be closed while serve() might still shut it
+        // down, in case it gets reused in between.
+        pthread_mutex_lock(&server->lock);
+        server->serving[w] = -1;
+        pthread_mutex_unlock(&server->lock);
+        if(in) {
+            fclose(in);
+        } else {
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+/**
+ *  Answers the requests read from <in>, the connection <fd>, until it ends, an
+ *  answer can't be sent, or a request is too long to make sense of.
+**/
+void serve_connection(int fd, FILE *in) {
+    char line[MAX_REQUEST_SIZE];
+    while(fgets(line, sizeof(line), in)) {
+        if(!strchr(line, '\n') && !feof(in)) {
+            static const char too_long[] = "ERROR Request too long.\n";
+            send_all(fd, too_long, sizeof(too_long) - 1);
+            return;
+        }
+        if(serve_request(fd, line)) {
+            return;
+        }
+    }
+}
+
+/**
+ *  Answers the request in <line> over the connection <fd>.
+ *  Returns 0 once the answer is sent, bad request or not, or -1 if it couldn't
+ *  be.
+**/
+int serve_request(int fd, char *line) {
+    char *words[MAX_REQUEST_SIZE / 2];
+    int num_words = 0;
+    char *rest;
+    for(char *word = strtok_r(line, " \t\r\n", &rest); word;
+        word = strtok_r(NULL, " \t\r\n", &rest)) {
+        words[num_words++] = word;
+    }
+
+    char status[ERROR_SIZE + 16];
+    char error[ERROR_SIZE];
+    long double frequencies[num_words + 1];
+    struct request request = {
+        .params = params,
+        .duration = duration,
+        .raw = raw_mode
+    };
+    struct sound *sound = NULL;
+    if(!parse_request(words, num_words, &request, frequencies, error) &&
+       !(sound = sound_create(&request.params))) {
+        snprintf(error, ERROR_SIZE, "%s.", strerror(errno));
+    }
+    if(!sound) {
+        int size = snprintf(status, sizeof(status), "ERROR %s\n", error);
+        return send_all(fd, status, size);
+    }
+
+    uint32_t sample_rate = request.params.sample_rate;
+    uint64_t num_samples = get_num_samples(request.duration, sample_rate);
+    uint64_t subchunk2_size = num_samples * BLOCK_ALIGN;
+    uint8_t header[MAX_HEADER_SIZE];
+    size_t header_size = request.raw ? 0 :
+        fill_header(header, sample_rate, subchunk2_size,
+                    (subchunk2_size + 36 > UINT32_MAX) ?
+                    HEADER_RF64 : HEADER_RIFF);
+    int size = snprintf(status, sizeof(status), "OK %llu\n",
+                        (unsigned long long)(header_size + subchunk2_size));
+    uint8_t bytes[RENDER_BLOCK_SIZE * BLOCK_ALIGN];
+    int result = (send_all(fd, status, size) ||
+                  send_all(fd, header, header_size) ||
+                  emit_samples(sound, num_samples, bytes, emit_to_socket,
+                               &fd)) ? -1 : 0;
+    sound_destroy(sound);
+    return result;
+}
+
+/**
+ *  Reads the <num_words> <words> of a request into <request> the way
+ *  process_flags() reads the command line, keeping its frequencies in
+ *  <frequencies>, which has room for one per word. Only the options in
+ *  <request_options> are taken; --file and the like belong to the server.
+ *  Returns 0 on success, or -1 with the reason in <error>.
+**/
+int parse_request(char **words, int num_words, struct request *request,
+                  long double *frequencies, char *error) {
+    size_t num_frequencies = 0;
+    for(int w = 0; w < num_words; w++) {
+        if(words[w][0] != '-') {
+            if(parse_float_opt(words[w], "Frequency", 1, 30000,
+                               &frequencies[num_frequencies++], error)) {
+                return -1;
+            }
+            continue;
+        }
+        const struct option *option = find_option(words[w]);
+        if(!option || !strchr(request_options, option->val)) {
+            snprintf(error, ERROR_SIZE, "Unrecognized option: %.*s.",
+                     ERROR_SIZE / 2, words[w]);
+            return -1;
+        }
+        // Arguments can be attached, as in "-d500" or "--duration=500", or
+        // be the next word.
+        const char *arg = NULL;
+        if(option->has_arg == required_argument) {
+            if(words[w][1] == '-') {
+                arg = strchr(words[w], '=');
+                arg = arg ? arg + 1 : NULL;
+            } else if(words[w][2]) {
+                arg = words[w] + 2;
+            }
+            if(!arg && w + 1 < num_words) {
+                arg = words[++w];
+            }
+            if(!arg) {
+                snprintf(error, ERROR_SIZE, "Option --%s needs an argument.",
+                         option->name);
+                return -1;
+            }
+        }
+        if(option->val == 'r') {
+            request->raw = 1;
+        } else if(process_sound_opt(option->val, arg, &request->params,
+                                    &request->duration, error)) {
+            return -1;
+        }
+    }
+    if(!num_frequencies) {
+        snprintf(error, ERROR_SIZE, "At least one frequency required.");
+        return -1;
+    }
+    request->params.num_frequencies = num_frequencies;
+    request->params.frequencies = frequencies;
+    request->params.length = get_num_samples(request->duration,
+                                             request->params.sample_rate);
+    return check_params(&request->params, error);
+}
+
+/**
+ *  Returns the entry of <options> that <word> names, either as "-x" or as
+ *  "--name", optionally followed by "=value", or NULL if none does. A short
+ *  option may have its argument attached.
+**/
+const struct option *find_option(const char *word) {
+    for(const struct option *option = options; option->name; option++) {
+        if(word[1] == '-') {
+            size_t length = strcspn(word + 2, "=");
+            if(length == strlen(option->name) &&
+               !strncmp(word + 2, option->name, length)) {
+                return option;
+            }
+        } else if(word[1] == option->val &&
+                  (!word[2] || option->has_arg == required_argument)) {
+            return option;
+        }
+    }
+    return NULL;
+}
+
+/**
+ *  Sends the <size> bytes at <data> over the socket <fd>, a piece at a time if
+ *  need be. A client that hangs up doesn't raise SIGPIPE.
+ *  Returns 0 once everything is sent, or -1 if it can't be.
+**/
+int send_all(int fd, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    while(size) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+/**
+ *  Sends the <size> bytes at <data> over the socket that <fd> points to, for
+ *  emit_samples().
+**/
+int emit_to_socket(void *fd, const void *data, size_t size) {
+    return send_all(*(int *)fd, data, size);
+}
+
+/**
+ *  Renders every sound listed in the manifest at <path>, each to its own file,
+ *  on <num_threads> threads. Returns the exit status: 0 if every file was
+ *  written, 1 if any wasn't.
+ *  The manifest is read, and every line checked, before anything is rendered.
+ *  The jobs are then dealt out evenly, and threads that finish early steal
+ *  from the rest, so one long sound doesn't hold up the jobs queued behind it.
+**/
+int run_batch(const char *path) {
+    struct batch_job *jobs;
+    size_t num_jobs = read_batch(path, &jobs);
+    if(cache_dir) {
+        mkdir(cache_dir, 0777);
+    }
+    uint16_t num_workers = (num_jobs < num_threads) ?
+                           (num_jobs ? num_jobs : 1) : num_threads;
+    struct batch_queue queues[num_workers];
+    struct batch_worker workers[num_workers];
+    pthread_t threads[num_workers];
+    for(uint16_t w = 0; w < num_workers; w++) {
+        pthread_mutex_init(&queues[w].lock, NULL);
+        queues[w].next = num_jobs * w / num_workers;
+        queues[w].end = num_jobs * (w + 1) / num_workers;
+        workers[w] = (struct batch_worker) {
+            .jobs = jobs,
+            .queues = queues,
+            .num_queues = num_workers,
+            .index = w,
+            .failures = 0
+        };
+    }
+    for(uint16_t w = 1; w < num_workers; w++) {
+        if(pthread_create(&threads[w], NULL, batch_worker, &workers[w])) {
+            fprintf(stderr, "%s: Failed to create batch thread.\n",
+                    program_name);
+            exit(1);
+        }
+    }
+    batch_worker(&workers[0]);
+    size_t failures = workers[0].failures;
+    for(uint16_t w = 1; w < num_workers; w++) {
+        pthread_join(threads[w], NULL);
+        failures += workers[w].failures;
+    }
+
+    for(uint16_t w = 0; w < num_workers; w++) {
+        pthread_mutex_destroy(&queues[w].lock);
+    }
+    for(size_t j = 0; j < num_jobs; j++) {
+        free(jobs[j].path);
+        free(jobs[j].frequencies);
+    }
+    free(jobs);
+    if(cache_dir) {
+        cache_evict();
+    }
+    return failures ? 1 : 0;
+}
+
+/**
+ *  Reads the manifest at <path> into a new array at <jobs>, and returns how
+ *  many jobs it holds. Blank lines and lines starting with '#' are skipped.
+ *  If the manifest can't be read, or any line of it is wrong, prints an error
+ *  message and exits the program.
+**/
+size_t read_batch(const char *path, struct batch_job **jobs) {
+    errno = 0;
+    FILE *manifest = fopen(path, "r");
+    if(!manifest) {
+        fprintf(stderr, "%s: %s: %s.\n", program_name, path, strerror(errno));
+        exit(1);
+    }
+    size_t num_jobs = 0;
+    size_t capacity = 0;
+    *jobs = NULL;
+    char *line = NULL;
+    size_t line_size = 0;
+    char error[ERROR_SIZE];
+    for(unsigned long number = 1; getline(&line, &line_size, manifest) >= 0;
+        number++) {
+        if(!line[strspn(line, " \t\r\n")] || line[0] == '#') {
+            continue;
+        }
+        if(num_jobs == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            *jobs = checked_realloc(*jobs, capacity * sizeof(**jobs));
+        }
+        if(parse_batch_line(line, &(*jobs)[num_jobs], error)) {
+            fprintf(stderr, "%s: %s:%lu: %s\n", program_name, path, number,
+                    error);
+            exit(1);
+        }
+        num_jobs++;
+    }
+    if(ferror(manifest)) {
+        fprintf(stderr, "%s: %s: Read failed.\n", program_name, path);
+        exit(1);
+    }
+    free(line);
+    fclose(manifest);
+    return num_jobs;
+}
+
+/**
+ *  Reads one <line> of a manifest into <job>. The line holds tab-separated
+ *  fields: the output path, the frequencies (separated by commas or spaces),
+ *  the duration, the wave function, the volume and the number of overtones.
+ *  Fields left empty or off the end keep what the command line gave, which
+ *  also decides everything else about the sound.
+ *  Returns 0 on success, or -1 with the reason in <error>.
+**/
+int parse_batch_line(char *line, struct batch_job *job, char *error) {
+    static const char field_options[] = "dwvo";
+    enum { PATH_FIELD, FREQUENCY_FIELD, OPTION_FIELDS };
+    char *fields[OPTION_FIELDS + sizeof(field_options) - 1] = {NULL};
+    size_t num_fields = 0;
+    line[strcspn(line, "\r\n")] = '\0';
+    for(char *field = line; field; num_fields++) {
+        if(num_fields == sizeof(fields) / sizeof(*fields)) {
+            snprintf(error, ERROR_SIZE, "Too many fields.");
+            return -1;
+        }
+        fields[num_fields] = field;
+        if((field = strchr(field, '\t'))) {
+            *field++ = '\0';
+        }
+    }
+
+    job->request = (struct request) {
+        .params = params,
+        .duration = duration,
+        .raw = raw_mode
+    };
+    for(size_t f = OPTION_FIELDS; f < num_fields; f++) {
+        if(*fields[f] && process_sound_opt(field_options[f - OPTION_FIELDS],
+                                           fields[f], &job->request.params,
+                                           &job->request.duration, error)) {
+            return -1;
+        }
+    }
+    if(!*fields[PATH_FIELD]) {
+        snprintf(error, ERROR_SIZE, "Output path required.");
+        return -1;
+    } else if(!fields[FREQUENCY_FIELD]) {
+        snprintf(error, ERROR_SIZE, "At least one frequency required.");
+        return -1;
+    }
+
+    size_t num_frequencies = 0;
+    job->frequencies = checked_malloc((strlen(fields[FREQUENCY_FIELD]) / 2 +
+                                       1) * sizeof(*job->frequencies));
+    char *rest;
+    for(char *word = strtok_r(fields[FREQUENCY_FIELD], ", ", &rest); word;
+        word = strtok_r(NULL, ", ", &rest)) {
+        if(parse_float_opt(word, "Frequency", 1, 30000,
+                           &job->frequencies[num_frequencies++], error)) {
+            free(job->frequencies);
+            return -1;
+        }
+    }
+    job->request.params.num_frequencies = num_frequencies;
+    job->request.params.frequencies = job->frequencies;
+    job->request.params.length =
+        get_num_samples(job->request.duration,
+                        job->request.params.sample_rate);
+    if(!num_frequencies) {
+        snprintf(error, ERROR_SIZE, "At least one frequency required.");
+        free(job->frequencies);
+        return -1;
+    } else if(check_params(&job->request.params, error)) {
+        free(job->frequencies);
+        return -1;
+    }
+    job->path = checked_malloc(strlen(fields[PATH_FIELD]) + 1);
+    strcpy(job->path, fields[PATH_FIELD]);
+    return 0;
+}
+
+/**
+ *  Body of each thread of a --batch, given its struct batch_worker. Renders
+ *  jobs until there are none left to take, counting the ones that fail.
+**/
+void *batch_worker(void *arg) {
+    struct batch_worker *worker = arg;
+    uint8_t *bytes = checked_malloc(RENDER_BLOCK_SIZE * BLOCK_ALIGN);
+    char error[ERROR_SIZE];
+    size_t j;
+    while(!take_batch_job(worker, &j)) {
+        if(render_batch_job(&worker->jobs[j], bytes, error)) {
+            fprintf(stderr, "%s: %s\n", program_name, error);
+            worker->failures++;
+        }
+    }
+    free(bytes);
+    return NULL;
+}
+
+/**
+ *  Puts the index of the next job for <worker> in <job>: the next from its own
+ *  queue, or, once that's empty, the first of the back half of the first other
+ *  queue with any left, whose rest become its own.
+ *  Returns 0 on success, or -1 once there's nothing left to take.
+**/
+int take_batch_job(struct batch_worker *worker, size_t *job) {
+    struct batch_queue *own = &worker->queues[worker->index];
+    pthread_mutex_lock(&own->lock);
+    if(own->next < own->end) {
+        *job = own->next++;
+        pthread_mutex_unlock(&own->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&own->lock);
+
+    // Only one lock is ever held at a time. A stolen range is in nobody's
+    // queue for a moment, but its thief is already committed to it, so the
+    // worst that can happen is that another thread gives up a little early.
+    for(uint16_t v = 1; v < worker->num_queues; v++) {
+        struct batch_queue *victim =
+            &worker->queues[(worker->index + v) % worker->num_queues];
+        pthread_mutex_lock(&victim->lock);
+        size_t left = victim->end - victim->next;
+        size_t first = victim->end - (left + 1) / 2;
+        size_t end = victim->end;
+        victim->end = first;
+        pthread_mutex_unlock(&victim->lock);
+        if(first < end) {
+            pthread_mutex_lock(&own->lock);
+            own->next = first + 1;
+            own->end = end;
+            pthread_mutex_unlock(&own->lock);
+            *job = first;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ *  Renders <job> to its file, using <bytes>, with room for RENDER_BLOCK_SIZE
+ *  samples, along the way.
+ *  Returns 0 on success, or -1 with the reason in <error>.
+**/
+int render_batch_job(const struct batch_job *job, uint8_t *bytes,
+                     char *error) {
+    const struct request *request = &job->request;
+    uint32_t sample_rate = request->params.sample_rate;
+    uint64_t num_samples = get_num_samples(request->duration, sample_rate);
+    errno = 0;
+    FILE *file = fopen(job->path, "w");
+    if(!file) {
+        snprintf(error, ERROR_SIZE, "%.*s: %s.", ERROR_SIZE / 2, job->path,
+                 strerror(errno));
+        return -1;
+    }
+
+    char key[CACHE_KEY_SIZE];
+    int failed = 1;
+    if(cache_dir) {
+        cache_key(&request->params, num_samples, request->raw, key);
+        failed = cache_fetch(key, fileno(file));
+    }
+    if(failed > 0) {
+        struct sound *sound = sound_create(&request->params);
+        if(!sound) {
+            snprintf(error, ERROR_SIZE, "%.*s: %s.", ERROR_SIZE / 2,
+                     job->path, strerror(errno));
+            fclose(file);
+            return -1;
+        }
+        uint64_t subchunk2_size = num_samples * BLOCK_ALIGN;
+        uint8_t header[MAX_HEADER_SIZE];
+        size_t header_size = request->raw ? 0 :
+            fill_header(header, sample_rate, subchunk2_size,
+                        (subchunk2_size + 36 > UINT32_MAX) ?
+                        HEADER_RF64 : HEADER_RIFF);
+        failed = emit_to_file(file, header, header_size) ||
+                 emit_samples(sound, num_samples, bytes, emit_to_file, file) ||
+                 fflush(file);
+        sound_destroy(sound);
+        if(!failed && cache_dir) {
+            cache_store(key, job->path);
+        }
+    }
+    failed |= fclose(file);
+    if(failed) {
+        snprintf(error, ERROR_SIZE, "%.*s: Write failed.", ERROR_SIZE / 2,
+                 job->path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ *  Writes the <size> bytes at <data> to <file>, for emit_samples().
+ *  Returns 0 on success, or -1 on failure.
+**/
+int emit_to_file(void *file, const void *data, size_t size) {
+    return (fwrite(data, 1, size, file) == size) ? 0 : -1;
+}
+
+/**
+ *  Puts the cache key of the first <num_samples> samples of the sound that
+ *  <params> describes, with a header unless <raw>, in <key>: the 128-bit
+ *  FNV-1a hash of a canonical description of them, in hex.
+ *  Everything that could change a byte of the output goes into the key, and
+ *  nothing else, so durations that come to the same number of samples share
+ *  one. Numbers go in as hexadecimal floating point, which is exact.
+**/
+void cache_key(const struct sound_params *params, uint64_t num_samples,
+               uint8_t raw, char *key) {
+    uint64_t hash[2] = {UINT64_C(0x6c62272e07bb0142),
+                        UINT64_C(0x62b821756295c58d)};
+    char text[256];
+    int length = snprintf(text, sizeof(text),
+                          "sound %d %u %La %d %u %d %d %d %d %u %u %u %La %u "
+                          "%d %llu %llu %u",
+                          CACHE_VERSION, params->sample_rate, params->volume,
+                          (int)params->wave, params->overtones,
+                          (int)params->wavetable, (int)params->sine_kernel,
+                          (int)params->precision, (int)params->additive,
+                          params->oversample, params->attack, params->decay,
+                          params->sustain, params->release,
+                          (int)params->curve,
+                          (unsigned long long)params->length,
+                          (unsigned long long)num_samples, raw);
+    hash_bytes(hash, text, length);
+    for(size_t f = 0; f < params->num_frequencies; f++) {
+        length = snprintf(text, sizeof(text), " %La", params->frequencies[f]);
+        hash_bytes(hash, text, length);
+    }
+    snprintf(key, CACHE_KEY_SIZE, "%016llx%016llx",
+             (unsigned long long)hash[0], (unsigned long long)hash[1]);
+}
+
+/**
+ *  Runs the <size> bytes at <data> through the 128-bit FNV-1a <hash>, whose
+ *  more significant half comes first.
+**/
+void hash_bytes(uint64_t *hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for(size_t i = 0; i < size; i++) {
+        hash[1] ^= bytes[i];
+        // Multiplies by the FNV prime, 2^88 + 0x13b, 32 bits at a time.
+        uint64_t low = (hash[1] & UINT32_MAX) * 0x13b;
+        uint64_t middle = (hash[1] >> 32) * 0x13b + (low >> 32);
+        hash[0] = hash[0] * 0x13b + (middle >> 32) + (hash[1] << 24);
+        hash[1] = (middle << 32) | (low & UINT32_MAX);
+    }
+}
+
+/**
+ *  Writes the render cached under <key> to <fd>, and marks it as just used.
+ *  Returns 0 on success, 1 if there is no such render, or -1 if it couldn't be
+ *  written.
+**/
+int cache_fetch(const char *key, int fd) {
+    char *path = cache_path(key);
+    int entry = open(path, O_RDONLY);
+    free(path);
+    if(entry < 0) {
+        return 1;
+    }
+    futimens(entry, NULL);
+    int result = copy_file_data(entry, fd);
+    close(entry);
+    return result;
+}
+
+/**
+ *  Copies the file at <path> into the cache under <key>. The copy is made
+ *  under a temporary name and then renamed into place, so other processes
+ *  never see part of one. A cache that can't be written to is no worse than
+ *  none at all, so failures are ignored.
+**/
+void cache_store(const char *key, const char *path) {
+    int file = open(path, O_RDONLY);
+    if(file < 0) {
+        return;
+    }
+    char *temp_path = cache_path(".tmp-XXXXXX");
+    int temp = mkstemp(temp_path);
+    if(temp >= 0) {
+        int failed = copy_file_data(file, temp);
+        failed |= close(temp);
+        char *entry_path = cache_path(key);
+        if(failed || rename(temp_path, entry_path)) {
+            unlink(temp_path);
+        }
+        free(entry_path);
+    }
+    free(temp_path);
+    close(file);
+}
+
+/**
+ *  Deletes the least recently used renders from the cache until what's left
+ *  fits in <cache_megabytes>. Renders that another process deletes first, or
+ *  adds meanwhile, are no trouble.
+**/
+void cache_evict(void) {
+    DIR *dir = opendir(cache_dir);
+    if(!dir) {
+        return;
+    }
+    struct cache_entry *entries = NULL;
+    size_t num_entries = 0;
+    size_t capacity = 0;
+    uint64_t total_size = 0;
+    for(struct dirent *d; (d = readdir(dir));) {
+        struct stat info;
+        if(strlen(d->d_name) != CACHE_KEY_SIZE - 1 ||
+           d->d_name[strspn(d->d_name, "0123456789abcdef")]) {
+            continue;
+        }
+        char *path = cache_path(d->d_name);
+        int found = !stat(path, &info) && S_ISREG(info.st_mode);
+        free(path);
+        if(!found) {
+            continue;
+        }
+        if(num_entries == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            entries = checked_realloc(entries, capacity * sizeof(*entries));
+        }
+        strcpy(entries[num_entries].key, d->d_name);
+        entries[num_entries].used = info.st_mtim;
+        entries[num_entries].size = info.st_size;
+        total_size += info.st_size;
+        num_entries++;
+    }
+    closedir(dir);
+
+    uint64_t limit = (uint64_t)cache_megabytes << 20;
+    if(total_size > limit) {
+        qsort(entries, num_entries, sizeof(*entries), compare_cache_entries);
+        for(size_t e = 0; e < num_entries && total_size > limit; e++) {
+            char *path = cache_path(entries[e].key);
+            if(!unlink(path)) {
+                total_size -= entries[e].size;
+            }
+            free(path);
+        }
+    }
+    free(entries);
+}
+
+/**
+ *  Orders struct cache_entry values from least to most recently used, for
+ *  qsort().
+**/
+int compare_cache_entries(const void *a, const void *b) {
+    const struct timespec *x = &((const struct cache_entry *)a)->used;
+    const struct timespec *y = &((const struct cache_entry *)b)->used;
+    if(x->tv_sec != y->tv_sec) {
+        return (x->tv_sec < y->tv_sec) ? -1 : 1;
+    }
+    return (x->tv_nsec < y->tv_nsec) ? -1 : (x->tv_nsec > y->tv_nsec);
+}
+
+/**
+ *  Returns the path of the file <name> in the cache directory, in memory that
+ *  the caller must free.
+**/
+char *cache_path(const char *name) {
+    char *path = checked_malloc(strlen(cache_dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", cache_dir, name);
+    return path;
+}
+
+/**
+ *  Copies all of the file <from>, from its beginning, to wherever <to> is.
+ *  Returns 0 on success, or -1 on failure.
+**/
+int copy_file_data(int from, int to) {
+    uint8_t buffer[CACHE_COPY_SIZE];
+    for(off_t offset = 0;;) {
+        ssize_t size = pread(from, buffer, sizeof(buffer), offset);
+        if(size < 0 && errno == EINTR) {
+            continue;
+        } else if(size <= 0) {
+            return size ? -1 : 0;
+        }
+        for(ssize_t written = 0; written < size;) {
+            ssize_t n = write(to, buffer + written, size - written);
+            if(n < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            written += n;
+        }
+        offset += size;
+    }
+}
+
+/**
+ *  Renders the score at <path> to the output file, in a single pass.
+**/
+void write_score(const char *path) {
+    struct note *notes;
+    size_t num_notes = read_score(path, &notes);
+    uint64_t num_samples = 0;
+    for(size_t n = 0; n < num_notes; n++) {
+        if(notes[n].end > num_samples) {
+            num_samples = notes[n].end;
+        }
+    }
+
+    uint8_t *destination = NULL;
+    if(append_mode) {
+        destination = append_sound_file(num_samples);
+    } else if(!raw_mode) {
+        create_sound_file(num_samples);
+    }
+    render_score(notes, num_notes, num_samples, destination);
+
+    for(size_t n = 0; n < num_notes; n++) {
+        free(notes[n].frequencies);
+    }
+    free(notes);
+}
+
+/**
+ *  Reads the score at <path> into a new array at <notes>, sorted by when they
+ *  start, and returns how many notes it holds. Blank lines and lines starting
+ *  with '#' are skipped.
+ *  If the score can't be read, or any line of it is wrong, prints an error
+ *  message and exits the program.
+**/
+size_t read_score(const char *path, struct note **notes) {
+    errno = 0;
+    FILE *score = fopen(path, "r");
+    if(!score) {
+        fprintf(stderr, "%s: %s: %s.\n", program_name, path, strerror(errno));
+        exit(1);
+    }
+    size_t num_notes = 0;
+    size_t capacity = 0;
+    *notes = NULL;
+    char *line = NULL;
+    size_t line_size = 0;
+    char error[ERROR_SIZE];
+    for(unsigned long number = 1; getline(&line, &line_size, score) >= 0;
+        number++) {
+        if(!line[strspn(line, " \t\r\n")] || line[0] == '#') {
+            continue;
+        }
+        if(num_notes == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            *notes = checked_realloc(*notes, capacity * sizeof(**notes));
+        }
+        (*notes)[num_notes].line = number;
+        if(parse_score_line(line, &(*notes)[num_notes], error)) {
+            fprintf(stderr, "%s: %s:%lu: %s\n", program_name, path, number,
+                    error);
+            exit(1);
+        }
+        num_notes++;
+    }
+    if(ferror(score)) {
+        fprintf(stderr, "%s: %s: Read failed.\n", program_name, path);
+        exit(1);
+    }
+    free(line);
+    fclose(score);
+    qsort(*notes, num_notes, sizeof(**notes), compare_notes);
+    return num_notes;
+}
+
+/**
+ *  Reads one <line> of a score into <note>. The line holds whitespace-separated
+ *  fields: the start and duration in milliseconds, the frequencies (separated
+ *  by commas), and optionally the wave function and volume. Everything else
+ *  about the note, and the wave and volume when they're left off, comes from
+ *  the command line.
+ *  Returns 0 on success, or -1 with the reason in <error>.
+**/
+int parse_score_line(char *line, struct note *note, char *error) {
+    enum { START_FIELD, DURATION_FIELD, FREQUENCY_FIELD, WAVE_FIELD,
+           VOLUME_FIELD, NUM_FIELDS };
+    char *fields[NUM_FIELDS] = {NULL};
+    size_t num_fields = 0;
+    char *rest;
+    for(char *field = strtok_r(line, " \t\r\n", &rest); field;
+        field = strtok_r(NULL, " \t\r\n", &rest)) {
+        if(num_fields == NUM_FIELDS) {
+            snprintf(error, ERROR_SIZE, "Too many fields.");
+            return -1;
+        }
+        fields[num_fields++] = field;
+    }
+    if(num_fields <= FREQUENCY_FIELD) {
+        snprintf(error, ERROR_SIZE, "A start, duration and frequencies "
+                 "required.");
+        return -1;
+    }
+
+    long start;
+    uint32_t length;
+    note->params = params;
+    if(parse_int_opt(fields[START_FIELD], "Start", 0, UINT32_MAX, &start,
+                     error) ||
+       process_sound_opt('d', fields[DURATION_FIELD], &note->params, &length,
+                         error) ||
+       (fields[WAVE_FIELD] && process_sound_opt('w', fields[WAVE_FIELD],
+                                                &note->params, &length,
+                                                error)) ||
+       (fields[VOLUME_FIELD] && process_sound_opt('v', fields[VOLUME_FIELD],
+                                                  &note->params, &length,
+                                                  error))) {
+        return -1;
+    }
+    // Both ends are rounded down, so that notes meet without overlapping.
+    note->start = (uint64_t)start * params.sample_rate / 1000;
+    note->end = ((uint64_t)start + length) * params.sample_rate / 1000;
+    if(note->end == note->start) {
+        note->end++;
+    }
+    note->params.length = note->end - note->start;
+
+    size_t num_frequencies = 0;
+    note->frequencies = checked_malloc((strlen(fields[FREQUENCY_FIELD]) / 2 +
+                                        1) * sizeof(*note->frequencies));
+    for(char *word = strtok_r(fields[FREQUENCY_FIELD], ",", &rest); word;
+        word = strtok_r(NULL, ",", &rest)) {
+        if(parse_float_opt(word, "Frequency", 1, 30000,
+                           &note->frequencies[num_frequencies++], error)) {
+            free(note->frequencies);
+            return -1;
+        }
+    }
+    note->params.num_frequencies = num_frequencies;
+    note->params.frequencies = note->frequencies;
+    if(!num_frequencies) {
+        snprintf(error, ERROR_SIZE, "At least one frequency required.");
+        free(note->frequencies);
+        return -1;
+    } else if(check_params(&note->params, error)) {
+        free(note->frequencies);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ *  Orders struct note values by when they start, then by where they are in
+ *  the score, for qsort().
+**/
+int compare_notes(const void *a, const void *b) {
+    const struct note *x = a;
+    const struct note *y = b;
+    if(x->start != y->start) {
+        return (x->start < y->start) ? -1 : 1;
+    }
+    return (x->line < y->line) ? -1 : (x->line > y->line);
+}
+
+/**
+ *  Mixes the <num_notes> <notes>, sorted by start, into <num_samples> samples
+ *  that go straight into <destination> if it isn't NULL, and to the output
+ *  file otherwise, RENDER_BLOCK_SIZE at a time.
+ *  Blocks are split at the sample each note starts on: a note takes a voice
+ *  from the pool right there, and gives it back once it ends, so each part
+ *  mixes just the notes sounding in it. Up to <num_voices> sound at once;
+ *  beyond that, the steal policy picks which to cut off, at the very sample
+ *  the new note starts.
+**/
+void render_score(const struct note *notes, size_t num_notes,
+                  uint64_t num_samples, uint8_t *destination) {
+    static double mix[RENDER_BLOCK_SIZE];
+    static double samples[RENDER_BLOCK_SIZE];
+    static uint8_t bytes[RENDER_BLOCK_SIZE * BLOCK_ALIGN];
+    size_t max_partials = 1;
+    for(size_t n = 0; n < num_notes; n++) {
+        size_t partials = ((size_t)notes[n].params.overtones + 1) *
+                          notes[n].params.num_frequencies;
+        if(partials > max_partials) {
+            max_partials = partials;
+        }
+    }
+    struct voice_pool pool;
+    init_voice_pool(&pool, (num_notes < num_voices) ?
+                           (num_notes ? num_notes : 1) : num_voices,
+                    max_partials);
+
+    size_t next = 0;
+    for(uint64_t t = 0; t < num_samples; t += RENDER_BLOCK_SIZE) {
+        size_t block_size = (num_samples - t < RENDER_BLOCK_SIZE) ?
+                            num_samples - t : RENDER_BLOCK_SIZE;
+        uint64_t block_end = t + block_size;
+        memset(mix, 0, block_size * sizeof(*mix));
+        for(uint64_t part = t; part < block_end;) {
+            retire_voices(&pool, part);
+            for(; next < num_notes && notes[next].start <= part; next++) {
+                start_voice(&pool, &notes[next]);
+            }
+            uint64_t part_end = (next < num_notes &&
+                                 notes[next].start < block_end) ?
+                                notes[next].start : block_end;
+            for(size_t v = 0; v < pool.num_active; v++) {
+                struct voice *voice = pool.active[v];
+                uint64_t to = (voice->end < part_end) ? voice->end : part_end;
+                if(part >= to) {
+                    continue;
+                }
+                sound_render_steps(voice->sound, samples, to - part);
+                for(uint64_t i = part; i < to; i++) {
+                    mix[i - t] += samples[i - part];
+                }
+            }
+            part = part_end;
+        }
+
+        if(destination) {
+            quantize_block(mix, block_size, destination + t * BLOCK_ALIGN);
+        } else {
+            quantize_block(mix, block_size, bytes);
+            checked_fwrite(bytes, block_size * BLOCK_ALIGN, out);
+        }
+    }
+    free_voice_pool(&pool);
+}
+
+/**
+ *  Fills <pool> with <capacity> free voices, each with room for
+ *  <max_partials> partials. If memory runs out, prints an error message and
+ *  exits the program.
+**/
+void init_voice_pool(struct voice_pool *pool, size_t capacity,
+                     size_t max_partials) {
+    pool->voices = checked_malloc(capacity * sizeof(*pool->voices));
+    pool->free = checked_malloc(capacity * sizeof(*pool->free));
+    pool->active = checked_malloc(capacity * sizeof(*pool->active));
+    pool->capacity = capacity;
+    pool->num_active = 0;
+    pool->num_free = 0;
+    for(size_t v = capacity; v--;) {
+        if(!(pool->voices[v].sound = sound_reserve(max_partials))) {
+            fprintf(stderr, "%s: %s.\n", program_name, strerror(errno));
+            exit(1);
+        }
+        pool->free[pool->num_free++] = &pool->voices[v];
+    }
+}
+
+/**
+ *  Frees every voice of <pool>, sounding or not.
+**/
+void free_voice_pool(struct voice_pool *pool) {
+    for(size_t v = 0; v < pool->capacity; v++) {
+        sound_destroy(pool->voices[v].sound);
+    }
+    free(pool->voices);
+    free(pool->free);
+    free(pool->active);
+}
+
+/**
+ *  Starts playing <note> on a free voice of <pool>, or on one stolen from
+ *  another note if none are free.
+**/
+void start_voice(struct voice_pool *pool, const struct note *note) {
+    struct voice *voice = pool->num_free ? pool->free[--pool->num_free] :
+                                           steal_voice(pool);
+    if(sound_reset(voice->sound, &note->params)) {
+        fprintf(stderr, "%s: %s.\n", program_name, strerror(errno));
+        exit(1);
+    }
+    voice->start = note->start;
+    voice->end = note->end;
+    voice->volume = note->params.volume;
+    size_t v = pool->num_active++;
+    for(; v && pool->active[v - 1]->end > voice->end; v--) {
+        pool->active[v] = pool->active[v - 1];
+    }
+    pool->active[v] = voice;
+}
+
+/**
+ *  Takes the voice that <steal_policy> picks out of the sounding ones of
+ *  <pool>, which are all of them, and returns it. How quiet a note is depends
+ *  on its volume and on how far along its envelope it is. Ties go to the note
+ *  that started first, then to the one that ends first.
+**/
+struct voice *steal_voice(struct voice_pool *pool) {
+    size_t victim = 0;
+    long double quietest = pool->active[0]->volume *
+                           sound_envelope_level(pool->active[0]->sound);
+    for(size_t v = 1; v < pool->num_active; v++) {
+        const struct voice *voice = pool->active[v];
+        long double level = voice->volume *
+                            sound_envelope_level(voice->sound);
+        if((steal_policy == STEAL_QUIETEST && level != quietest) ?
+           level < quietest : voice->start < pool->active[victim]->start) {
+            victim = v;
+            quietest = level;
+        }
+    }
+    struct voice *voice = pool->active[victim];
+    pool->num_active--;
+    memmove(pool->active + victim, pool->active + victim + 1,
+            (pool->num_active - victim) * sizeof(*pool->active));
+    return voice;
+}
+
+/**
+ *  Frees the voices of <pool> whose notes end by sample <t>. Since those come
+ *  first, they're taken from the front.
+**/
+void retire_voices(struct voice_pool *pool, uint64_t t) {
+    size_t finished = 0;
+    while(finished < pool->num_active && pool->active[finished]->end <= t) {
+        pool->free[pool->num_free++] = pool->active[finished++];
+    }
+    pool->num_active -= finished;
+    memmove(pool->active, pool->active + finished,
+            pool->num_active * sizeof(*pool->active));
+}
+
+/**
+ *  Converts the <size> samples of <mix>, in 16-bit steps, to 16-bit
+ *  little-endian PCM in <bytes> the way libsound does: clipping whatever
+ *  overlapping notes pushed past full scale, then truncating toward zero.
+**/
+void quantize_block(const double *mix, size_t size, uint8_t *bytes) {
+    for(size_t i = 0; i < size; i++) {
+        double clamped = (mix[i] > INT16_MAX) ? INT16_MAX :
+                         (mix[i] < INT16_MIN) ? INT16_MIN : mix[i];
+        store_int_data(bytes + i * BLOCK_ALIGN, (uint16_t)(int16_t)clamped,
+                       BLOCK_ALIGN);
+    }
+}
+
+/**
+ *  Prepare to write <data_length> samples to the output file. Data chunks too
+ *  large for a plain RIFF header get an RF64 one instead.
+**/
+void create_sound_file(uint64_t data_length) {
+    uint64_t subchunk2_size = data_length * NUM_CHANNELS * BITS_PER_SAMPLE / 8;
+    uint8_t header[MAX_HEADER_SIZE];
+    build_header(header, subchunk2_size, (subchunk2_size + 36 > UINT32_MAX) ?
+                                         HEADER_RF64 : HEADER_RIFF);
+    checked_fwrite(header, data_offset, out);
+}
+
+/**
+ *  Prepare to write a stream of unknown length to the output file. The size
+ *  fields are left as UNKNOWN_SIZE, which is how a stream that never gets to
+ *  go back and fill them in (a pipe, say) ends up. Regular files get room for
+ *  a ds64 chunk as well, in case the stream outgrows RIFF.
+**/
+void create_stream_file(void) {
+    struct stat info;
+    uint8_t seekable = !fstat(fileno(out), &info) && S_ISREG(info.st_mode);
+    uint8_t header[MAX_HEADER_SIZE];
+    build_header(header, UNKNOWN_LENGTH,
+                 seekable ? HEADER_RESERVED : HEADER_RIFF);
+    checked_fwrite(header, data_offset, out);
+}
+
+/**
+ *  Fills <header> with a complete header of the given <layout> for the output
+ *  file, whose data chunk holds <subchunk2_size> bytes, or UNKNOWN_LENGTH, and
+ *  points <data_offset> just past it.
+**/
+void build_header(uint8_t *header, uint64_t subchunk2_size,
+                  enum header_layout layout) {
+    data_offset = fill_header(header, params.sample_rate, subchunk2_size,
+                              layout);
+    is_rf64 = (layout == HEADER_RF64);
+}
+
+/**
+ *  Fills <header> with a complete header of the given <layout> for a data
+ *  chunk of <subchunk2_size> bytes, or UNKNOWN_LENGTH, sampled at
+ *  <sample_rate>, and returns the size of the header.
+ *  Nothing but <header> is touched, so the threads of the server can use it.
+**/
+size_t fill_header(uint8_t *header, uint32_t sample_rate,
+                   uint64_t subchunk2_size, enum header_layout layout) {
+    size_t header_size = (layout == HEADER_RIFF) ?
+                         DATA_OFFSET : DATA_OFFSET + DS64_CHUNK_SIZE;
+    uint8_t rf64 = (layout == HEADER_RF64);
+    size_t shift = header_size - DATA_OFFSET;
+    uint64_t riff_size = (subchunk2_size == UNKNOWN_LENGTH) ?
+                         UNKNOWN_LENGTH : header_size - 8 + subchunk2_size;
+    memcpy(header + CHUNK_ID_OFFSET, rf64 ? RF64_CHUNK_ID : CHUNK_ID,
+           CHUNK_ID_SIZE);
+    store_int_data(header + CHUNK_SIZE_OFFSET,
+                   (rf64 || riff_size > UINT32_MAX) ?
+                   UNKNOWN_SIZE : riff_size, CHUNK_SIZE_SIZE);
+    memcpy(header + FORMAT_OFFSET, FORMAT, FORMAT_SIZE);
+    if(layout != HEADER_RIFF) {
+        memset(header + DS64_ID_OFFSET, 0, DS64_CHUNK_SIZE);
+        memcpy(header + DS64_ID_OFFSET, rf64 ? DS64_ID : JUNK_ID,
+               DS64_ID_SIZE);
+        store_int_data(header + DS64_SIZE_OFFSET, DS64_SIZE, DS64_SIZE_SIZE);
+    }
+    if(rf64) {
+        store_int_data(header + DS64_RIFF_SIZE_OFFSET, riff_size,
+                       DS64_RIFF_SIZE_SIZE);
+        store_int_data(header + DS64_DATA_SIZE_OFFSET, subchunk2_size,
+                       DS64_DATA_SIZE_SIZE);
+        store_int_data(header + DS64_SAMPLE_COUNT_OFFSET,
+                       subchunk2_size / BLOCK_ALIGN, DS64_SAMPLE_COUNT_SIZE);
+    }
+    memcpy(header + SUBCHUNK1_ID_OFFSET + shift, SUBCHUNK1_ID,
+           SUBCHUNK1_ID_SIZE);
+    store_int_data(header + SUBCHUNK1_SIZE_OFFSET + shift, SUBCHUNK1_SIZE,
+                   SUBCHUNK1_SIZE_SIZE);
+    store_int_data(header + AUDIO_FORMAT_OFFSET + shift, AUDIO_FORMAT,
+                   AUDIO_FORMAT_SIZE);
+    store_int_data(header + NUM_CHANNELS_OFFSET + shift, NUM_CHANNELS,
+                   NUM_CHANNELS_SIZE);
+    store_int_data(header + SAMPLE_RATE_OFFSET + shift, sample_rate,
+                   SAMPLE_RATE_SIZE);
+    store_int_data(header + BYTE_RATE_OFFSET + shift, BYTE_RATE(sample_rate),
+                   BYTE_RATE_SIZE);
+    store_int_data(header + BLOCK_ALIGN_OFFSET + shift, BLOCK_ALIGN,
+                   BLOCK_ALIGN_SIZE);
+    store_int_data(header + BITS_PER_SAMPLE_OFFSET + shift, BITS_PER_SAMPLE,
+                   BITS_PER_SAMPLE_SIZE);
+    memcpy(header + SUBCHUNK2_ID_OFFSET + shift, SUBCHUNK2_ID,
+           SUBCHUNK2_ID_SIZE);
+    store_int_data(header + SUBCHUNK2_SIZE_OFFSET + shift,
+                   (rf64 || subchunk2_size > UINT32_MAX) ?
+                   UNKNOWN_SIZE : subchunk2_size, SUBCHUNK2_SIZE_SIZE);
+    return header_size;
+}
+
+/**
+ *  Returns the layout the header of the output file should take now that its
+ *  data chunk is <subchunk2_size> bytes. Files only ever move towards RF64.
+**/
+enum header_layout current_layout(uint64_t subchunk2_size) {
+    if(is_rf64 || data_offset - 8 + subchunk2_size > UINT32_MAX) {
+        return HEADER_RF64;
+    }
+    return (data_offset == DATA_OFFSET) ? HEADER_RIFF : HEADER_RESERVED;
+}
+
+
+/**
+ *  Prepare to write <new_data_length> samples to the end of hte output file,
+ *  by erifying and then adjusting the header as needed.
+ *  Both RIFF and RF64 files are accepted. Unless streaming, the file is grown
+ *  to its final size up front and mapped into memory; the returned pointer is
+ *  where the new samples go. A RIFF file that grows past what RIFF can
+ *  describe is promoted to RF64 on the way.
+**/
+uint8_t *append_sound_file(uint64_t new_data_length) {
+    // How much larger is the data chunk going to get?
+    uint64_t subchunk2_size_addition = new_data_length * NUM_CHANNELS *
+                                       BITS_PER_SAMPLE / 8;
+
+    // Read in as much as the largest possible header in one go.
+    uint8_t header[MAX_HEADER_SIZE];
+    checked_fseek(out, 0, SEEK_SET);
+    size_t header_size = fread(header, 1, MAX_HEADER_SIZE, out);
+    if(header_size < DATA_OFFSET) {
+        fprintf(stderr, "%s: %s: Read failed.\n", program_name, out_name);
+        exit(1);
+    }
+
+    // Is there a ds64 chunk, or room for one, ahead of the format chunk?
+    is_rf64 = !memcmp(header + CHUNK_ID_OFFSET, RF64_CHUNK_ID, CHUNK_ID_SIZE);
+    data_offset = (is_rf64 || !memcmp(header + DS64_ID_OFFSET, JUNK_ID,
+                                      DS64_ID_SIZE)) ?
+                  DATA_OFFSET + DS64_CHUNK_SIZE : DATA_OFFSET;
+    long shift = data_offset - DATA_OFFSET;
+    if(header_size < (size_t)data_offset) {
+        fprintf(stderr, "%s: %s: Read failed.\n", program_name, out_name);
+        exit(1);
+    }
+
+    // How large was the previous data chunk?
+    uint64_t prev_subchunk2_size = is_rf64 ?
+        load_int_data(header + DS64_DATA_SIZE_OFFSET, DS64_DATA_SIZE_SIZE) :
+        load_int_data(header + CHUNK_SIZE_OFFSET, CHUNK_SIZE_SIZE) -
+        (data_offset - 8);
+
+    // Make sure that all header fields are the expected values before rewriting
+    // any of them.
+    verify_string_header(header, "Chunk ID", is_rf64 ? RF64_CHUNK_ID : CHUNK_ID,
+                         CHUNK_ID_OFFSET, CHUNK_ID_SIZE);
+    verify_string_header(header, "Format", FORMAT, FORMAT_OFFSET, FORMAT_SIZE);
+    if(is_rf64) {
+        verify_int_header(header, "Chunk size", UNKNOWN_SIZE,
+                          CHUNK_SIZE_OFFSET, CHUNK_SIZE_SIZE);
+        verify_string_header(header, "ds64 ID", DS64_ID, DS64_ID_OFFSET,
+                             DS64_ID_SIZE);
+        verify_int_header(header, "ds64 size", DS64_SIZE, DS64_SIZE_OFFSET,
+                          DS64_SIZE_SIZE);
+        verify_int_header(header, "RIFF size",
+                          prev_subchunk2_size + data_offset - 8,
+                          DS64_RIFF_SIZE_OFFSET, DS64_RIFF_SIZE_SIZE);
+    }
+    verify_string_header(header, "Subchunk 1 ID", SUBCHUNK1_ID,
+                         SUBCHUNK1_ID_OFFSET + shift, SUBCHUNK1_ID_SIZE);
+    verify_int_header(header, "Subchunk 1 size", SUBCHUNK1_SIZE,
+                      SUBCHUNK1_SIZE_OFFSET + shift, SUBCHUNK1_SIZE_SIZE);
+    verify_int_header(header, "Audio format", AUDIO_FORMAT,
+                      AUDIO_FORMAT_OFFSET + shift, AUDIO_FORMAT_SIZE);
+    verify_int_header(header, "Number of channels", NUM_CHANNELS,
+                      NUM_CHANNELS_OFFSET + shift, NUM_CHANNELS_SIZE);
+    verify_int_header(header, "Sample rate", params.sample_rate,
+                      SAMPLE_RATE_OFFSET + shift, SAMPLE_RATE_SIZE);
+    verify_int_header(header, "Byte rate", BYTE_RATE(params.sample_rate),
+                      BYTE_RATE_OFFSET + shift, BYTE_RATE_SIZE);
+    verify_int_header(header, "Block align", BLOCK_ALIGN,
+                      BLOCK_ALIGN_OFFSET + shift, BLOCK_ALIGN_SIZE);
+    verify_int_header(header, "Bits per sample", BITS_PER_SAMPLE,
+                      BITS_PER_SAMPLE_OFFSET + shift, BITS_PER_SAMPLE_SIZE);
+    verify_string_header(header, "Subchunk 2 ID", SUBCHUNK2_ID,
+                         SUBCHUNK2_ID_OFFSET + shift, SUBCHUNK2_ID_SIZE);
+    verify_int_header(header, "Subchunk 2 size",
+                      is_rf64 ? UNKNOWN_SIZE : prev_subchunk2_size,
+                      SUBCHUNK2_SIZE_OFFSET + shift, SUBCHUNK2_SIZE_SIZE);
+
+    // A stream writes its new data through <out> as usual, and sorts out the
+    // header once it knows how long it ran for.
+    if(stream_mode) {
+        checked_fseek(out, data_offset + prev_subchunk2_size, SEEK_SET);
+        return NULL;
+    }
+
+    // Otherwise, grow the file to its final size, then update the fields
+    // dependent on the size of the data chunk in place. If a ds64 chunk is
+    // needed and there's no room for one yet, make some.
+    uint64_t subchunk2_size = prev_subchunk2_size + subchunk2_size_addition;
+    uint8_t promote = (current_layout(subchunk2_size) == HEADER_RF64 && !shift);
+    map_out(data_offset + subchunk2_size + (promote ? DS64_CHUNK_SIZE : 0));
+    if(promote) {
+        insert_ds64_chunk(prev_subchunk2_size);
+    }
+    build_header(out_map, subchunk2_size, current_layout(subchunk2_size));
+
+    // The new data begins at the end of the existing data chunk.
+    return out_map + data_offset + prev_subchunk2_size;
+}
+
+/**
+ *  Grows the output file to <size> bytes, making sure the space is really
+ *  there so that writes to the mapping can't fail later, then maps all of it
+ *  into memory at <out_map>.
+**/
+void map_out(uint64_t size) {
+    int fd = fileno(out);
+    checked_fflush(out);
+    errno = 0;
+    if(ftruncate(fd, size)) {
+        fprintf(stderr, "%s: %s: %s.\n", program_name, out_name,
+                strerror(errno));
+        exit(1);
+    }
+    // Not every file system can preallocate; those that can't will just have
+    // to take their chances.
+    int error = posix_fallocate(fd, 0, size);
+    if(error && error != EINVAL && error != EOPNOTSUPP) {
+        fprintf(stderr, "%s: %s: %s.\n", program_name, out_name,
+                strerror(error));
+        exit(1);
+    }
+    errno = 0;
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "%s: %s: %s.\n", program_name, out_name,
+                strerror(errno));
+        exit(1);
+    }
+    out_map = map;
+    out_map_size = size;
+}
+
+/**
+ *  Makes room for a ds64 chunk in the mapping of a plain RIFF file whose data
+ *  chunk holds <subchunk2_size> bytes, by moving everything after the format
+ *  ID back DS64_CHUNK_SIZE bytes. The mapping must already be large enough.
+**/
+void insert_ds64_chunk(uint64_t subchunk2_size) {
+    memmove(out_map + DS64_ID_OFFSET + DS64_CHUNK_SIZE,
+            out_map + DS64_ID_OFFSET,
+            DATA_OFFSET - DS64_ID_OFFSET + subchunk2_size);
+    data_offset = DATA_OFFSET + DS64_CHUNK_SIZE;
+}
+
+/**
+ *  Fills in the size fields of the header once a stream has ended, going by
+ *  how much data precedes the current position. Outputs that can't seek keep
+ *  their UNKNOWN_SIZE fields.
+**/
+void finish_stream_file(void) {
+    checked_fflush(out);
+    long end = ftell(out);
+    if(end < data_offset) {
+        return;
+    }
+    uint64_t subchunk2_size = end - data_offset;
+    if(current_layout(subchunk2_size) == HEADER_RF64 &&
+       data_offset == DATA_OFFSET) {
+        // New streams to regular files always leave room for a ds64 chunk, so
+        // only a stream appended to a plain RIFF file can end up here.
+        map_out(end + DS64_CHUNK_SIZE);
+        insert_ds64_chunk(subchunk2_size);
+        build_header(out_map, subchunk2_size, HEADER_RF64);
+        return;
+    }
+    uint8_t header[MAX_HEADER_SIZE];
+    build_header(header, subchunk2_size, current_layout(subchunk2_size));
+    checked_pwrite(fileno(out), header, data_offset, 0);
+}
+
+/**
+ *  Checks to make sure that <header> matches the given number <field> of
+ *  <size> bytes at the given position <offset>.
+**/
+void verify_int_header(const uint8_t *header, const char *field_name,
+                       size_t field, size_t offset, uint8_t size) {
+    size_t value = load_int_data(header + offset, size);
+    if(field != value) {
+        fprintf(stderr, "%s: %s: Header field '%s' appears to be corrupted.\n",
+                program_name, out_name, field_name);
+        fprintf(stderr, "Expected value: %zu; encountered value: %zu.\n",
+                field, value);
+        exit(1);
+    }
+}
+
+/**
+ *  Checks to make sure that <header> matches the given string <field> of
+ *  <size> bytes at the given position <offset>.
+**/
+void verify_string_header(const uint8_t *header, const char *field_name,
+                          const char *field, size_t offset, size_t size) {
+    if(memcmp(header + offset, field, size)) {
+        fprintf(stderr, "%s: %s: Header field '%s' appears to be corrupted.\n",
+                program_name, out_name, field_name);
+        fprintf(stderr, "Expected value: \"%s\"; encountered value: "
+                "\"%.*s\".\n", field, (int)size,
+                (const char *)header + offset);
+        exit(1);
+    }
+}
+
+/**
+ *  Stores <num_bytes> of the integer given in <data> at <dest>, in ascending
+ *  order from least to most significant bytes.
+**/
+void store_int_data(uint8_t *dest, size_t data, uint8_t num_bytes) {
+    for(uint8_t i = 0; i < num_bytes; i++, data >>= CHAR_BIT) {
+        dest[i] = data & UCHAR_MAX;
+    }
+}
+
+/**
+ *  Converts the <num_bytes> bytes at <src> to an unsigned integer, assuming
+ *  they are in ascending order from least to most significant byte.
+**/
+size_t load_int_data(const uint8_t *src, uint8_t num_bytes) {
+    size_t result = 0;
+    for(uint8_t i = 0; i < num_bytes; i++) {
+        result += (size_t)src[i] << (CHAR_BIT * i);
+    }
+    return result;
+}
+
+/**
+ *  Writes the <size> bytes at <data> to <file>. If failure is detected, prints
+ *  an error message and exits the program.
+**/
+void checked_fwrite(const void *data, size_t size, FILE *file) {
+    if(fwrite(data, 1, size, file) != size) {
+        fprintf(stderr, "%s: %s: Write failed.\n", program_name, out_name);
+        exit(1);
+    }
+}
+
+/**
+ *  Writes the <size> bytes at <data> to the file descriptor <fd>, starting at
+ *  <offset>. If failure is detected, prints an error message and exits the
+ *  program.
+**/
+void checked_pwrite(int fd, const void *data, size_t size, off_t offset) {
+    const uint8_t *bytes = data;
+    while(size) {
+        ssize_t written = pwrite(fd, bytes, size, offset);
+        if(written < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "%s: %s: Write failed.\n", program_name, out_name);
+            exit(1);
+        }
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+/**
+ *  Flushes any buffered output in <file>. If failure is detected, prints an
+ *  error message and exits the program.
+**/
+void checked_fflush(FILE *file) {
+    if(fflush(file)) {
+        fprintf(stderr, "%s: %s: Write failed.\n", program_name, out_name);
+        exit(1);
+    }
+}
+
+/**
+ *  Returns the current position in <file>. If failure is detected, prints an
+ *  error message and exits the program.
+**/
+long checked_ftell(FILE *file) {
+    long result = ftell(file);
+    if(result < 0) {
+        fprintf(stderr, "%s: %s: Seek failed.\n", program_name, out_name);
+        exit(1);
+    }
+    return result;
+}
+
+/**
+ *  Allocates <size> bytes. If failure is detected, prints an error message and
+ *  exits the program.
+**/
+void *checked_malloc(size_t size) {
+    void *result = malloc(size);
+    if(!result) {
+        fprintf(stderr, "%s: Out of memory.\n", program_name);
+        exit(1);
+    }
+    return result;
+}
+
+/**
+ *  Resizes the allocation at <data> to <size> bytes. If failure is detected,
+ *  prints an error message and exits the program.
+**/
+void *checked_realloc(void *data, size_t size) {
+    void *result = realloc(data, size);
+    if(!result) {
+        fprintf(stderr, "%s: Out of memory.\n", program_name);
+        exit(1);
+    }
+    return result;
+}
+
+/**
+ *  Attempts to perform a call to fseek with the provided arguments. If failure
+ *  is detected, prints an error message and exists the program.
+**/
+void checked_fseek(FILE *file, long offset, int whence) {
+    if(fseek(file, offset, whence)) {
+        fprintf(stderr, "%s: %s: Seek failed.\n", program_name, out_name);
+        exit(1);
+    }
+}
+
+/**
+ *  Close the file stream <out>, and unmap it if it was mapped. Intended for
+ *  use as an exit handler.
+**/
+void close_out(void) {
+    if(out_map) {
+        munmap(out_map, out_map_size);
+    }
     fclose(out);
 }
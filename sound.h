@@ -0,0 +1,188 @@
+/**
+ *
+ *      sound.h
+ *      The interface to libsound, which renders the sounds that sound.c
+ *  writes to .wav files.
+ *      Everything a sound needs lives in the struct sound that sound_create()
+ *  returns, so any number of them can be rendered at once, from any number of
+ *  threads, as long as no two threads render or advance the same one at the
+ *  same time. The only state shared between them is a set of tables that
+ *  depend on nothing but the wave, built the first time they're needed and
+ *  never changed afterwards.
+ *
+**/
+
+#ifndef SOUND_H
+#define SOUND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The shape of every partial of a sound. */
+enum sound_wave {
+    SOUND_WAVE_SINE,
+    SOUND_WAVE_SQUARE,
+    SOUND_WAVE_TRIANGLE,
+    SOUND_WAVE_SAWTOOTH,
+    SOUND_WAVE_POINT,
+    SOUND_WAVE_CIRCLE,
+    SOUND_WAVE_POLYBLEP_SQUARE,     /* Square, with its steps smoothed. */
+    SOUND_WAVE_POLYBLEP_SAWTOOTH,   /* Sawtooth, with its step smoothed. */
+    SOUND_WAVE_POLYBLEP_TRIANGLE    /* Triangle, with its corners smoothed. */
+};
+
+/* How samples are read from a wavetable, if one is used at all. */
+enum sound_wavetable {
+    SOUND_WAVETABLE_OFF,
+    SOUND_WAVETABLE_LINEAR,
+    SOUND_WAVETABLE_CUBIC
+};
+
+/**
+ *  How sine waves are computed when not read from a wavetable. The rotation
+ *  kernel is the default: it renders about twice as fast, and its phasor is
+ *  re-seeded from the exact phase every 1024 samples instead of being
+ *  renormalized, which keeps it close enough to the polynomial that 16-bit
+ *  renders in double precision come out the same either way.
+**/
+enum sound_sine_kernel {
+    SOUND_SINE_POLYNOMIAL,  /* Every sample from the polynomial. */
+    SOUND_SINE_ROTATION     /* By rotating a phasor seeded from a polynomial. */
+};
+
+/* What samples are mixed in before they are quantized. */
+enum sound_precision {
+    SOUND_PRECISION_FLOAT,
+    SOUND_PRECISION_DOUBLE,
+    SOUND_PRECISION_LONG_DOUBLE,
+    SOUND_PRECISION_Q31     /* 64-bit fixed point, from a table of sines. */
+};
+
+/* How the partials are summed. */
+enum sound_additive {
+    SOUND_ADDITIVE_AUTO,        /* Inverse FFT for many sines, float/double. */
+    SOUND_ADDITIVE_DIRECT,      /* One oscillator at a time, every sample. */
+    SOUND_ADDITIVE_INVERSE_FFT  /* By overlap-adding inverse FFTs of frames. */
+};
+
+/* The shape of each segment of an envelope. */
+enum sound_curve {
+    SOUND_CURVE_LINEAR,
+    SOUND_CURVE_EXPONENTIAL     /* Quick at first, then easing in. */
+};
+
+/**
+ *  Everything that describes a sound. sound_default_params() fills in what the
+ *  command line defaults to; <frequencies> has no default.
+ *  Each of the <num_frequencies> <frequencies>, in Hz, gets <overtones>
+ *  partials above it at 2, 3, 4, ... times its frequency. The <volume> is a
+ *  percentage of full scale, shared evenly between every partial. Sounds can
+ *  be rendered at <oversample> times the <sample_rate>, 1, 2, 4 or 8, and then
+ *  filtered back down to it. The inverse-FFT engine only renders sine waves,
+ *  without a wavetable.
+ *  The sound rises from silence over its first <attack> milliseconds, falls to
+ *  <sustain> percent of its volume over the <decay> milliseconds after, and
+ *  stays there. If it has a <length>, in samples, it falls silent over the
+ *  last <release> milliseconds of it, and stays silent after it; a <length> of
+ *  0 means it never ends. A release too long for the sound is shortened to
+ *  start once the attack is over, or halfway through if the sound is shorter
+ *  than twice its attack. Each of these follows the <curve>.
+**/
+struct sound_params {
+    uint32_t sample_rate;
+    long double volume;
+    enum sound_wave wave;
+    uint16_t overtones;
+    enum sound_wavetable wavetable;
+    enum sound_sine_kernel sine_kernel;
+    enum sound_precision precision;
+    enum sound_additive additive;
+    uint8_t oversample;
+    uint32_t attack;
+    uint32_t decay;
+    long double sustain;
+    uint32_t release;
+    enum sound_curve curve;
+    uint64_t length;
+    size_t num_frequencies;
+    const long double *frequencies;
+};
+
+/* A sound being rendered, and where each of its partials is in its cycle. */
+struct sound;
+
+/**
+ *  Fills <params> with the defaults of the command line.
+**/
+void sound_default_params(struct sound_params *params);
+
+/**
+ *  Returns a new sound described by <params>, at the start of every cycle, or
+ *  NULL with errno set to EINVAL if <params> don't describe one, or ENOMEM.
+ *  <params> and the frequencies they point to aren't needed afterwards.
+**/
+struct sound *sound_create(const struct sound_params *params);
+
+/**
+ *  Returns a new sound with room for <max_partials> partials (frequencies
+ *  times overtones plus one), or NULL with errno set to EINVAL if
+ *  <max_partials> is 0, or ENOMEM. It can't be rendered until sound_reset()
+ *  gives it a sound to make.
+**/
+struct sound *sound_reserve(size_t max_partials);
+
+/**
+ *  Makes <sound> into a new sound described by <params>, at the start of every
+ *  cycle, without allocating anything (but the first wavetable of each wave).
+ *  Returns 0, or -1 with errno set to EINVAL if <params> don't describe a
+ *  sound, or ENOMEM if the sound needs more partials than <sound> has room
+ *  for, leaving <sound> unchanged.
+**/
+int sound_reset(struct sound *sound, const struct sound_params *params);
+
+/**
+ *  Frees <sound>. Does nothing with NULL.
+**/
+void sound_destroy(struct sound *sound);
+
+/**
+ *  Renders the next <frames> samples of <sound> into <buffer>, where 1 is full
+ *  scale, and moves the sound past them.
+**/
+void sound_render(struct sound *sound, float *buffer, size_t frames);
+
+/**
+ *  Renders the next <frames> samples of <sound> into <buffer> the way
+ *  sound_render_pcm16() would before quantizing them: in 16-bit steps, so
+ *  that full scale is INT16_MAX, and at the precision the sound was made
+ *  with. Then moves the sound past them. Truncating a sample toward zero,
+ *  after clamping it to the 16-bit range, gives the PCM sample.
+**/
+void sound_render_steps(struct sound *sound, double *buffer, size_t frames);
+
+/**
+ *  Renders <frames> samples of <sound> as 16-bit little-endian PCM into
+ *  <bytes>, beginning <start> samples after where the sound is now, without
+ *  moving it. Any number of threads may do this with the same sound at once.
+**/
+void sound_render_pcm16(const struct sound *sound, uint8_t *bytes,
+                        uint64_t start, size_t frames);
+
+/**
+ *  Moves <sound> <frames> samples further along.
+**/
+void sound_advance(struct sound *sound, uint64_t frames);
+
+/**
+ *  Returns the number of samples after which <sound> repeats itself exactly,
+ *  or 0 if it doesn't within a few million samples, or has an envelope.
+**/
+uint64_t sound_period(const struct sound *sound);
+
+/**
+ *  Returns how far along its envelope has brought <sound> where it is now,
+ *  from 0 (silent) to 1 (its full volume).
+**/
+double sound_envelope_level(const struct sound *sound);
+
+#endif